@@ -0,0 +1,164 @@
+/* stub_scene.c - just enough of wlroots for wallpaper.c to run headless
+ *
+ * Buffers follow wlroots' lock and drop rules, so wallpapers are freed
+ * exactly when they would be in dwl. Scene nodes only remember what they
+ * were given; nothing is rendered.
+ */
+#include <stdlib.h>
+#include <wayland-server-core.h>
+#include <wlr/interfaces/wlr_buffer.h>
+#include <wlr/types/wlr_output.h>
+#include <wlr/types/wlr_scene.h>
+
+static void buffer_consider_destroy(struct wlr_buffer *buffer) {
+	if (!buffer->dropped || buffer->n_locks > 0)
+		return;
+	wl_signal_emit_mutable(&buffer->events.destroy, NULL);
+	buffer->impl->destroy(buffer);
+}
+
+void wlr_buffer_init(struct wlr_buffer *buffer, const struct wlr_buffer_impl *impl,
+		int width, int height) {
+	*buffer = (struct wlr_buffer){
+		.impl = impl,
+		.width = width,
+		.height = height,
+	};
+	wl_signal_init(&buffer->events.destroy);
+	wl_signal_init(&buffer->events.release);
+}
+
+void wlr_buffer_drop(struct wlr_buffer *buffer) {
+	if (!buffer)
+		return;
+	buffer->dropped = true;
+	buffer_consider_destroy(buffer);
+}
+
+struct wlr_buffer *wlr_buffer_lock(struct wlr_buffer *buffer) {
+	buffer->n_locks++;
+	return buffer;
+}
+
+void wlr_buffer_unlock(struct wlr_buffer *buffer) {
+	if (!buffer)
+		return;
+	if (--buffer->n_locks == 0)
+		wl_signal_emit_mutable(&buffer->events.release, NULL);
+	buffer_consider_destroy(buffer);
+}
+
+void wlr_output_transformed_resolution(struct wlr_output *output,
+		int *width, int *height) {
+	if (output->transform % 2 == 0) {
+		*width = output->width;
+		*height = output->height;
+	} else {
+		*width = output->height;
+		*height = output->width;
+	}
+}
+
+static void node_init(struct wlr_scene_node *node, enum wlr_scene_node_type type,
+		struct wlr_scene_tree *parent) {
+	node->type = type;
+	node->parent = parent;
+	node->enabled = true;
+	wl_list_init(&node->link);
+	wl_signal_init(&node->events.destroy);
+}
+
+struct wlr_scene_tree *wlr_scene_tree_create(struct wlr_scene_tree *parent) {
+	struct wlr_scene_tree *tree = calloc(1, sizeof(*tree));
+
+	if (!tree)
+		return NULL;
+	node_init(&tree->node, WLR_SCENE_NODE_TREE, parent);
+	wl_list_init(&tree->children);
+	return tree;
+}
+
+struct wlr_scene_buffer *wlr_scene_buffer_create(struct wlr_scene_tree *parent,
+		struct wlr_buffer *buffer) {
+	struct wlr_scene_buffer *sb = calloc(1, sizeof(*sb));
+
+	if (!sb)
+		return NULL;
+	node_init(&sb->node, WLR_SCENE_NODE_BUFFER, parent);
+	wl_signal_init(&sb->events.outputs_update);
+	wl_signal_init(&sb->events.output_enter);
+	wl_signal_init(&sb->events.output_leave);
+	wl_signal_init(&sb->events.output_sample);
+	wl_signal_init(&sb->events.frame_done);
+	sb->opacity = 1.0f;
+	wlr_scene_buffer_set_buffer(sb, buffer);
+	return sb;
+}
+
+void wlr_scene_buffer_set_buffer(struct wlr_scene_buffer *scene_buffer,
+		struct wlr_buffer *buffer) {
+	if (buffer == scene_buffer->buffer)
+		return;
+	if (buffer)
+		wlr_buffer_lock(buffer);
+	wlr_buffer_unlock(scene_buffer->buffer);
+	scene_buffer->buffer = buffer;
+}
+
+void wlr_scene_buffer_set_source_box(struct wlr_scene_buffer *scene_buffer,
+		const struct wlr_fbox *box) {
+	scene_buffer->src_box = box ? *box : (struct wlr_fbox){0};
+}
+
+void wlr_scene_buffer_set_dest_size(struct wlr_scene_buffer *scene_buffer,
+		int width, int height) {
+	scene_buffer->dst_width = width;
+	scene_buffer->dst_height = height;
+}
+
+void wlr_scene_buffer_set_transform(struct wlr_scene_buffer *scene_buffer,
+		enum wl_output_transform transform) {
+	scene_buffer->transform = transform;
+}
+
+void wlr_scene_buffer_set_opacity(struct wlr_scene_buffer *scene_buffer,
+		float opacity) {
+	scene_buffer->opacity = opacity;
+}
+
+void wlr_scene_buffer_set_opaque_region(struct wlr_scene_buffer *scene_buffer,
+		const pixman_region32_t *region) {
+	/* Only used for occlusion, which nothing here renders */
+	(void)scene_buffer;
+	(void)region;
+}
+
+void wlr_scene_node_set_enabled(struct wlr_scene_node *node, bool enabled) {
+	node->enabled = enabled;
+}
+
+void wlr_scene_node_set_position(struct wlr_scene_node *node, int x, int y) {
+	node->x = x;
+	node->y = y;
+}
+
+void wlr_scene_node_lower_to_bottom(struct wlr_scene_node *node) {
+	(void)node;
+}
+
+void wlr_scene_node_destroy(struct wlr_scene_node *node) {
+	struct wlr_scene_buffer *sb;
+	struct wlr_scene_tree *tree;
+
+	if (!node)
+		return;
+	wl_signal_emit_mutable(&node->events.destroy, NULL);
+	if (node->type == WLR_SCENE_NODE_BUFFER) {
+		sb = wl_container_of(node, sb, node);
+		wlr_scene_buffer_set_buffer(sb, NULL);
+		free(sb);
+	} else if (node->type == WLR_SCENE_NODE_TREE) {
+		tree = wl_container_of(node, tree, node);
+		free(tree);
+	}
+}
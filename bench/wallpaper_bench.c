@@ -0,0 +1,444 @@
+/* wallpaper_bench.c - time the wallpaper pipeline against a stub scene
+ *
+ * wallpaper.c is built into this program so its decode and scale steps
+ * can be timed one at a time, with stub_scene.c standing in for wlroots.
+ * Results are printed as one JSON object on stdout, progress on stderr.
+ *
+ *   wallpaper-bench [-q] [-f box|bilinear|lanczos3] [image...]
+ *
+ * Without images, noisy gradients are written as PPM at every standard
+ * size and used as sources. -q only runs 1080p and 4K.
+ *
+ * Allocations are counted through -Wl,--wrap=malloc,--wrap=calloc,
+ * --wrap=realloc, which the bench target links with. That covers
+ * wallpaper.c, stb_image, resample.c and pixel.c, but not libc itself.
+ */
+#include "wallpaper.c"
+
+#include <sys/resource.h>
+
+#define BENCH_MIN_NS 250000000LL /* keep repeating a case this long */
+#define BENCH_MAX_RUNS 20
+
+typedef struct {
+	const char *name;
+	int width, height;
+	int quick; /* also run with -q */
+} Size;
+
+static const Size sizes[] = {
+	{ "1080p", 1920, 1080, 1 },
+	{ "1440p", 2560, 1440, 0 },
+	{ "4k", 3840, 2160, 1 },
+	{ "5k", 5120, 2880, 0 },
+	{ "8k", 7680, 4320, 0 },
+};
+
+static const char *mode_names[] = { "tile", "center", "fit", "cover" };
+static const char *filter_names[] = { "box", "bilinear", "lanczos3" };
+
+/* Source image, decoded once for the scale cases */
+typedef struct {
+	char path[MAX_PATH];
+	char name[64];
+	int width, height;
+	unsigned char *rgba;
+} Source;
+
+/* Result of timing one case */
+typedef struct {
+	int runs;
+	long long best_ns, median_ns;
+	size_t allocs, alloc_bytes; /* per run */
+	long peak_rss_kb;
+} Timing;
+
+typedef void (*BenchFunc)(void *data);
+
+static size_t allocs, alloc_bytes;
+static int rss_reset = 1;
+static int quick;
+static int ncases;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+	allocs++;
+	alloc_bytes += size;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+	allocs++;
+	alloc_bytes += n * size;
+	return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+	allocs++;
+	alloc_bytes += size;
+	return __real_realloc(ptr, size);
+}
+
+static long long now_ns(void) {
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (long long)t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+/* Start counting peak RSS afresh, where the kernel allows it */
+static void reset_peak_rss(void) {
+	int fd;
+
+	if (!rss_reset)
+		return;
+	fd = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+	if (fd < 0 || write(fd, "5", 1) != 1)
+		rss_reset = 0;
+	if (fd >= 0)
+		close(fd);
+}
+
+static long peak_rss_kb(void) {
+	struct rusage ru;
+	char line[256];
+	long kb = -1;
+	FILE *f;
+
+	if (rss_reset && (f = fopen("/proc/self/status", "r"))) {
+		while (fgets(line, sizeof(line), f))
+			if (sscanf(line, "VmHWM: %ld kB", &kb) == 1)
+				break;
+		fclose(f);
+		if (kb >= 0)
+			return kb;
+	}
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_maxrss;
+}
+
+static int cmp_ll(const void *a, const void *b) {
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void time_case(BenchFunc func, void *data, Timing *t) {
+	long long ns[BENCH_MAX_RUNS], start, total = 0;
+	size_t a0, b0;
+
+	reset_peak_rss();
+	a0 = allocs;
+	b0 = alloc_bytes;
+	for (t->runs = 0; t->runs < BENCH_MAX_RUNS && total < BENCH_MIN_NS; t->runs++) {
+		start = now_ns();
+		func(data);
+		ns[t->runs] = now_ns() - start;
+		total += ns[t->runs];
+	}
+	t->peak_rss_kb = peak_rss_kb();
+	t->allocs = (allocs - a0) / t->runs;
+	t->alloc_bytes = (alloc_bytes - b0) / t->runs;
+
+	qsort(ns, t->runs, sizeof(ns[0]), cmp_ll);
+	t->best_ns = ns[0];
+	t->median_ns = ns[t->runs / 2];
+}
+
+static void print_string(const char *s) {
+	putchar('"');
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			printf("\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			printf("\\u%04x", *s);
+		else
+			putchar(*s);
+	}
+	putchar('"');
+}
+
+/* One entry of "cases"; source, output and mode are left out when NULL */
+static void print_case(const char *name, const Source *src, const Size *out,
+		const char *mode, long long pixels, const Timing *t) {
+	printf("%s\n    {\"name\": \"%s\"", ncases++ ? "," : "", name);
+	if (src) {
+		printf(", \"source\": ");
+		print_string(src->name);
+		printf(", \"source_size\": [%d, %d]", src->width, src->height);
+	}
+	if (out)
+		printf(", \"output\": \"%s\", \"output_size\": [%d, %d]",
+				out->name, out->width, out->height);
+	if (mode)
+		printf(", \"mode\": \"%s\"", mode);
+	printf(", \"pixels\": %lld, \"runs\": %d, \"best_ns\": %lld, \"median_ns\": %lld"
+			", \"ns_per_pixel\": %.3f, \"allocs\": %zu, \"alloc_bytes\": %zu"
+			", \"peak_rss_kb\": %ld}",
+			pixels, t->runs, t->best_ns, t->median_ns,
+			(double)t->best_ns / (double)pixels, t->allocs, t->alloc_bytes,
+			t->peak_rss_kb);
+	fflush(stdout);
+}
+
+/* Vector path pixel.c picks on this machine */
+static const char *simd_name(void) {
+#if defined(__x86_64__)
+	return __builtin_cpu_supports("avx2") ? "avx2" : "sse2";
+#elif defined(__aarch64__)
+	return "neon";
+#else
+	return "scalar";
+#endif
+}
+
+/* Noisy diagonal gradient, so neither decoding nor resampling sees long
+ * flat runs */
+static int write_ppm(const char *path, int width, int height) {
+	unsigned char *row;
+	uint32_t seed = 0x9e3779b9;
+	FILE *f;
+	int x, y, ok;
+
+	f = fopen(path, "wb");
+	row = malloc((size_t)width * 3);
+	if (!f || !row) {
+		if (f)
+			fclose(f);
+		free(row);
+		return 0;
+	}
+	fprintf(f, "P6\n%d %d\n255\n", width, height);
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++) {
+			seed = seed * 1664525 + 1013904223;
+			row[x * 3] = (unsigned char)(x * 255 / width + (seed >> 29));
+			row[x * 3 + 1] = (unsigned char)(y * 255 / height + (seed >> 26 & 7));
+			row[x * 3 + 2] = (unsigned char)((x + y) * 127 / (width + height) + (seed >> 23 & 7));
+		}
+		fwrite(row, 3, (size_t)width, f);
+	}
+	free(row);
+	ok = !ferror(f);
+	return fclose(f) == 0 && ok;
+}
+
+typedef struct {
+	Source *src;
+	const Size *out;
+	int mode;
+	int filter;
+} ScaleCase;
+
+static void bench_decode(void *data) {
+	Source *src = data;
+	WallpaperJob job = {0};
+	unsigned char *rgba;
+	int w, h, opaque;
+
+	snprintf(job.path, sizeof(job.path), "%s", src->path);
+	job.scale_mode = SCALE_CENTER; /* always at full size */
+	rgba = load_image(&job, &w, &h, &opaque);
+	stbi_image_free(rgba);
+}
+
+/* In place: the colours only feed timings, and a fresh buffer would
+ * mostly measure page faults */
+static void bench_swizzle(void *data) {
+	Source *src = data;
+
+	pixel_swizzle(src->rgba, src->rgba, (size_t)src->width * src->height);
+}
+
+static void bench_scale(void *data) {
+	ScaleCase *c = data;
+
+	free(scale_image(c->src->rgba, c->src->width, c->src->height,
+			c->out->width, c->out->height, c->mode, c->filter));
+}
+
+static void bench_scene_scale(void *data) {
+	ScaleCase *c = data;
+	JobTarget t = {0};
+
+	t.width = c->out->width;
+	t.height = c->out->height;
+	free(scene_image(c->src->rgba, c->src->width, c->src->height,
+			&t, c->mode, c->filter));
+}
+
+static void bench_gradient(void *data) {
+	(void)data;
+	load_gradient_fallback();
+}
+
+/* A wallpaper output as wallpaper_output_update makes it, without
+ * loading anything into it */
+static WallpaperOutput *add_output(struct wlr_output *output, const Size *size) {
+	WallpaperOutput *o = calloc(1, sizeof(*o));
+
+	if (!o)
+		return NULL;
+	o->scene_buffer = wlr_scene_buffer_create(wp.tree, NULL);
+	if (!o->scene_buffer) {
+		free(o);
+		return NULL;
+	}
+	o->output = output;
+	o->id = ++wp.next_output_id;
+	o->width = o->buf_width = size->width;
+	o->height = o->buf_height = size->height;
+	wl_list_insert(wp.outputs.prev, &o->link);
+	return o;
+}
+
+static void usage(void) {
+	fprintf(stderr, "usage: wallpaper-bench [-q] [-f box|bilinear|lanczos3] [image...]\n");
+	exit(2);
+}
+
+int main(int argc, char *argv[]) {
+	static struct wlr_scene scene;
+	struct wlr_output output = {0};
+	char dir[] = "/tmp/wallpaper-bench.XXXXXX";
+	char path[MAX_PATH];
+	Source *sources;
+	ScaleCase sc;
+	Timing t;
+	WallpaperJob job = {0};
+	int nsources = 0, filter = WallpaperFilterLanczos3;
+	int opt, i, j, mode, opaque;
+
+	while ((opt = getopt(argc, argv, "qf:")) != -1) {
+		if (opt == 'q') {
+			quick = 1;
+		} else if (opt == 'f') {
+			for (filter = 0; filter < (int)LENGTH(filter_names); filter++)
+				if (strcmp(optarg, filter_names[filter]) == 0)
+					break;
+			if (filter == (int)LENGTH(filter_names))
+				usage();
+		} else {
+			usage();
+		}
+	}
+
+	if (!mkdtemp(dir)) {
+		fprintf(stderr, "wallpaper-bench: cannot create %s: %s\n", dir, strerror(errno));
+		return 1;
+	}
+	/* Keep wallpaper_init's disk cache out of the real one */
+	setenv("XDG_CACHE_HOME", dir, 1);
+	wallpaper_init(&scene, NULL, dir, 0);
+	wallpaper_set_filter(filter);
+	wl_signal_init(&output.events.destroy);
+
+	sources = calloc(argc > optind ? (size_t)(argc - optind) : LENGTH(sizes), sizeof(*sources));
+	if (!sources)
+		return 1;
+	if (argc > optind) {
+		for (i = optind; i < argc; i++) {
+			Source *src = &sources[nsources++];
+			const char *base = strrchr(argv[i], '/');
+
+			snprintf(src->path, sizeof(src->path), "%s", argv[i]);
+			snprintf(src->name, sizeof(src->name), "%s", base ? base + 1 : argv[i]);
+		}
+	} else {
+		for (i = 0; i < (int)LENGTH(sizes); i++) {
+			Source *src;
+
+			if (quick && !sizes[i].quick)
+				continue;
+			src = &sources[nsources++];
+			snprintf(src->path, sizeof(src->path), "%s/%s.ppm", dir, sizes[i].name);
+			snprintf(src->name, sizeof(src->name), "%s", sizes[i].name);
+			fprintf(stderr, "wallpaper-bench: writing %s\n", src->path);
+			if (!write_ppm(src->path, sizes[i].width, sizes[i].height)) {
+				fprintf(stderr, "wallpaper-bench: cannot write %s\n", src->path);
+				return 1;
+			}
+		}
+	}
+	job.scale_mode = SCALE_CENTER;
+	for (i = 0; i < nsources; i++) {
+		snprintf(job.path, sizeof(job.path), "%s", sources[i].path);
+		sources[i].rgba = load_image(&job, &sources[i].width, &sources[i].height, &opaque);
+		if (!sources[i].rgba) {
+			fprintf(stderr, "wallpaper-bench: cannot decode %s\n", sources[i].path);
+			return 1;
+		}
+	}
+
+	printf("{\n  \"benchmark\": \"wallpaper\",\n  \"simd\": \"%s\",\n"
+			"  \"filter\": \"%s\",\n  \"jpeg_scale\": %s,\n"
+			"  \"rss_reset\": %s,\n  \"cases\": [",
+			simd_name(), filter_names[filter],
+#ifdef JPEG_SCALE
+			"true",
+#else
+			"false",
+#endif
+			rss_reset ? "true" : "false");
+
+	for (i = 0; i < nsources; i++) {
+		Source *src = &sources[i];
+
+		fprintf(stderr, "wallpaper-bench: %s (%dx%d)\n", src->name, src->width, src->height);
+		time_case(bench_decode, src, &t);
+		print_case("decode", src, NULL, NULL, (long long)src->width * src->height, &t);
+		time_case(bench_swizzle, src, &t);
+		print_case("swizzle", src, NULL, NULL, (long long)src->width * src->height, &t);
+
+		sc.src = src;
+		sc.filter = filter;
+		for (j = 0; j < (int)LENGTH(sizes); j++) {
+			if (quick && !sizes[j].quick)
+				continue;
+			sc.out = &sizes[j];
+			for (mode = SCALE_TILE; mode <= SCALE_COVER; mode++) {
+				sc.mode = mode;
+				time_case(bench_scale, &sc, &t);
+				print_case("scale", src, sc.out, mode_names[mode],
+						(long long)sc.out->width * sc.out->height, &t);
+				if (mode == SCALE_TILE)
+					continue; /* the scene never scales tiles */
+				time_case(bench_scene_scale, &sc, &t);
+				print_case("scene_scale", src, sc.out, mode_names[mode],
+						(long long)sc.out->width * sc.out->height, &t);
+			}
+		}
+		stbi_image_free(src->rgba);
+	}
+
+	for (j = 0; j < (int)LENGTH(sizes); j++) {
+		if (quick && !sizes[j].quick)
+			continue;
+		output.width = sizes[j].width;
+		output.height = sizes[j].height;
+		if (!add_output(&output, &sizes[j]))
+			return 1;
+		time_case(bench_gradient, NULL, &t);
+		print_case("gradient", NULL, &sizes[j], NULL,
+				(long long)sizes[j].width * sizes[j].height, &t);
+		wallpaper_output_remove(&output);
+	}
+	printf("\n  ]\n}\n");
+
+	wallpaper_cleanup();
+
+	/* Generated sources and the empty disk cache */
+	if (argc <= optind)
+		for (i = 0; i < nsources; i++)
+			unlink(sources[i].path);
+	free(sources);
+	snprintf(path, sizeof(path), "%s/dwl/wallpapers", dir);
+	rmdir(path);
+	snprintf(path, sizeof(path), "%s/dwl", dir);
+	rmdir(path);
+	rmdir(dir);
+	return 0;
+}
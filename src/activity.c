@@ -0,0 +1,102 @@
+/* activity.c - which outputs can be seen, for pausing background work
+ *
+ * dwl reports power, lock and fullscreen changes here, and the wallpaper,
+ * bar and tray ask before doing work nobody would see. Outputs without
+ * reasons have no entry.
+ */
+#include <stdlib.h>
+
+#include "activity.h"
+
+typedef struct {
+	struct wl_list link;
+	struct wlr_output *output;
+	unsigned int reasons;
+	struct wl_listener destroy;
+} ActivityOutput;
+
+static struct {
+	int ready;
+	unsigned int reasons; /* for all outputs */
+	struct wl_list outputs; /* ActivityOutput.link */
+	struct wl_signal changed;
+} act;
+
+static void init(void) {
+	if (act.ready)
+		return;
+	wl_list_init(&act.outputs);
+	wl_signal_init(&act.changed);
+	act.ready = 1;
+}
+
+static ActivityOutput *find(struct wlr_output *output) {
+	ActivityOutput *a;
+
+	wl_list_for_each(a, &act.outputs, link) {
+		if (a->output == output)
+			return a;
+	}
+	return NULL;
+}
+
+static void drop(ActivityOutput *a) {
+	wl_list_remove(&a->link);
+	wl_list_remove(&a->destroy.link);
+	free(a);
+}
+
+static void handle_output_destroy(struct wl_listener *listener, void *data) {
+	ActivityOutput *a = wl_container_of(listener, a, destroy);
+
+	drop(a);
+}
+
+void activity_set(struct wlr_output *output, unsigned int reason, int on) {
+	ActivityOutput *a = NULL;
+	unsigned int *reasons;
+	unsigned int old;
+
+	init();
+	if (!output) {
+		reasons = &act.reasons;
+	} else if ((a = find(output))) {
+		reasons = &a->reasons;
+	} else {
+		if (!on)
+			return;
+		a = calloc(1, sizeof(*a));
+		if (!a)
+			return;
+		a->output = output;
+		a->destroy.notify = handle_output_destroy;
+		wl_signal_add(&output->events.destroy, &a->destroy);
+		wl_list_insert(&act.outputs, &a->link);
+		reasons = &a->reasons;
+	}
+
+	old = *reasons;
+	if (on)
+		*reasons |= reason;
+	else
+		*reasons &= ~reason;
+	if (*reasons == old)
+		return;
+
+	if (output && !*reasons)
+		drop(a);
+	wl_signal_emit_mutable(&act.changed, output);
+}
+
+unsigned int activity_hidden(struct wlr_output *output) {
+	ActivityOutput *a;
+
+	init();
+	a = output ? find(output) : NULL;
+	return act.reasons | (a ? a->reasons : 0);
+}
+
+void activity_add_listener(struct wl_listener *listener) {
+	init();
+	wl_signal_add(&act.changed, listener);
+}
@@ -0,0 +1,27 @@
+/* activity.h - which outputs can be seen, for pausing background work */
+#ifndef ACTIVITY_H
+#define ACTIVITY_H
+
+#include <wayland-server-core.h>
+#include <wlr/types/wlr_output.h>
+
+/* Reasons an output cannot be seen */
+enum {
+	ActivityAsleep  = 1 << 0, /* Powered off through output power management */
+	ActivityLocked  = 1 << 1, /* Session locked, set for all outputs at once */
+	ActivityCovered = 1 << 2, /* Background and bar under a fullscreen client */
+};
+
+/* Add or clear a reason output cannot be seen, NULL for all outputs.
+ * Listeners are only notified when the reasons actually change. */
+void activity_set(struct wlr_output *output, unsigned int reason, int on);
+
+/* Reasons output cannot be seen, 0 if it can */
+unsigned int activity_hidden(struct wlr_output *output);
+
+/* Call listener with the struct wlr_output whose reasons changed, or NULL
+ * when they changed for all outputs. Work skipped while hidden should be
+ * caught up with a single update once the output can be seen again. */
+void activity_add_listener(struct wl_listener *listener);
+
+#endif /* ACTIVITY_H */
@@ -20,6 +20,16 @@ static const float rootcolor[]             = COLOR(0x000000ff);
 /* wallpaper settings */
 static const char *wallpaper_dir           = "~/Pictures/Wallpapers"; /* directory containing subdirectories of wallpapers */
 static const int wallpaper_interval        = 300; /* seconds between wallpaper changes, 0 to disable slideshow */
+static const int wallpaper_filter          = WallpaperFilterLanczos3; /* WallpaperFilterBox, WallpaperFilterBilinear or WallpaperFilterLanczos3 */
+static const int wallpaper_scene_scaling   = 0; /* 1 to let the compositor scale wallpapers instead of the CPU, using less memory */
+static const int wallpaper_transition      = WallpaperTransitionNone; /* WallpaperTransitionNone, Fade, Wipe or Slide */
+static const int wallpaper_transition_ms   = 400; /* length of transitions between wallpapers */
+static const int wallpaper_cache_mb        = 256; /* memory for scaled wallpapers kept for going back, 0 to disable */
+static const int wallpaper_anim_mb         = 128; /* memory for the frames of an animated GIF wallpaper */
+static const int wallpaper_disk_cache_mb   = 1024; /* scaled wallpapers kept in $XDG_CACHE_HOME/dwl/wallpapers, 0 to disable */
+static const int wallpaper_disk_cache_days = 30; /* drop cached wallpapers unused for this many days */
+static const float wallpaper_shader_scale  = 1.0f; /* shader wallpaper render size relative to the output, 0.25-1.0 */
+static const int wallpaper_shader_budget_ms = 8; /* shader time per frame before rendering smaller or slower, 0 to disable */
 
 /* This conforms to the xdg-protocol. Set the alpha to zero to restore the old behavior */
 static const float fullscreen_bg[]         = {0.0f, 0.0f, 0.0f, 1.0f}; /* You can also use glsl colors */
@@ -0,0 +1,273 @@
+/* pixel.c - pixel format kernels shared by wallpapers and the tray
+ *
+ * Every kernel has a scalar version that defines the result and vector
+ * versions that process whole registers and leave the tail to it.
+ * Premultiplying divides by 255 with rounding as (c * a + 127) / 255,
+ * computed in 16 bits as (v + 1 + (v >> 8)) >> 8, which is exact for
+ * every c and a.
+ */
+#include "pixel.h"
+
+#if defined(__x86_64__)
+#define PIXEL_X86
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define PIXEL_NEON
+#include <arm_neon.h>
+#endif
+
+static inline unsigned char div255(unsigned int v) {
+	v += 127;
+	return (unsigned char)((v + 1 + (v >> 8)) >> 8);
+}
+
+static void swizzle_scalar(unsigned char *dst, const unsigned char *src, size_t n) {
+	unsigned char r, b;
+	size_t i;
+
+	for (i = 0; i < n; i++, src += 4, dst += 4) {
+		r = src[0];
+		b = src[2];
+		dst[0] = b;
+		dst[1] = src[1];
+		dst[2] = r;
+		dst[3] = src[3];
+	}
+}
+
+static void premultiply_scalar(uint32_t *dst, const unsigned char *src, size_t n) {
+	unsigned int a;
+	size_t i;
+
+	for (i = 0; i < n; i++, src += 4) {
+		a = src[0];
+		dst[i] = (uint32_t)a << 24
+			| (uint32_t)div255(src[1] * a) << 16
+			| (uint32_t)div255(src[2] * a) << 8
+			| (uint32_t)div255(src[3] * a);
+	}
+}
+
+static void fill_scalar(uint32_t *dst, uint32_t value, size_t n) {
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		dst[i] = value;
+}
+
+#ifdef PIXEL_X86
+/* SSE2 has no byte shuffle, so R and B trade places with shifts */
+static size_t swizzle_sse2(unsigned char *dst, const unsigned char *src, size_t n) {
+	const __m128i ga = _mm_set1_epi32((int)0xff00ff00);
+	const __m128i low = _mm_set1_epi32(0xff);
+	__m128i p;
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		p = _mm_loadu_si128((const __m128i *)(src + i * 4));
+		p = _mm_or_si128(_mm_and_si128(p, ga),
+				_mm_or_si128(_mm_and_si128(_mm_srli_epi32(p, 16), low),
+				_mm_slli_epi32(_mm_and_si128(p, low), 16)));
+		_mm_storeu_si128((__m128i *)(dst + i * 4), p);
+	}
+	return i;
+}
+
+/* Two pixels widened to 16 bits: premultiply, keep alpha, reverse bytes */
+static inline __m128i premultiply_sse2_half(__m128i p) {
+	const __m128i alpha_lane = _mm_set_epi16(0, 0, 0, -1, 0, 0, 0, -1);
+	const __m128i bias = _mm_set1_epi16(127);
+	const __m128i one = _mm_set1_epi16(1);
+	__m128i a, v;
+
+	a = _mm_shufflelo_epi16(p, _MM_SHUFFLE(0, 0, 0, 0));
+	a = _mm_shufflehi_epi16(a, _MM_SHUFFLE(0, 0, 0, 0));
+	v = _mm_add_epi16(_mm_mullo_epi16(p, a), bias);
+	v = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(v, one), _mm_srli_epi16(v, 8)), 8);
+	v = _mm_or_si128(_mm_andnot_si128(alpha_lane, v), _mm_and_si128(alpha_lane, p));
+	v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+	return _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+}
+
+static size_t premultiply_sse2(uint32_t *dst, const unsigned char *src, size_t n) {
+	const __m128i zero = _mm_setzero_si128();
+	__m128i p, lo, hi;
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		p = _mm_loadu_si128((const __m128i *)(src + i * 4));
+		lo = premultiply_sse2_half(_mm_unpacklo_epi8(p, zero));
+		hi = premultiply_sse2_half(_mm_unpackhi_epi8(p, zero));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+	}
+	return i;
+}
+
+static size_t fill_sse2(uint32_t *dst, uint32_t value, size_t n) {
+	const __m128i v = _mm_set1_epi32((int)value);
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4)
+		_mm_storeu_si128((__m128i *)(dst + i), v);
+	return i;
+}
+
+__attribute__((target("avx2")))
+static size_t swizzle_avx2(unsigned char *dst, const unsigned char *src, size_t n) {
+	const __m256i order = _mm256_setr_epi8(
+			2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+			2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+	__m256i p;
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		p = _mm256_loadu_si256((const __m256i *)(src + i * 4));
+		_mm256_storeu_si256((__m256i *)(dst + i * 4), _mm256_shuffle_epi8(p, order));
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+static size_t premultiply_avx2(uint32_t *dst, const unsigned char *src, size_t n) {
+	/* Per pixel: broadcast alpha, then reverse A R G B to B G R A */
+	const __m256i alpha = _mm256_setr_epi8(
+			0, -1, 0, -1, 0, -1, 0, -1, 8, -1, 8, -1, 8, -1, 8, -1,
+			0, -1, 0, -1, 0, -1, 0, -1, 8, -1, 8, -1, 8, -1, 8, -1);
+	const __m256i reverse = _mm256_setr_epi8(
+			6, 7, 4, 5, 2, 3, 0, 1, 14, 15, 12, 13, 10, 11, 8, 9,
+			6, 7, 4, 5, 2, 3, 0, 1, 14, 15, 12, 13, 10, 11, 8, 9);
+	const __m256i alpha_lane = _mm256_set1_epi64x(0xffff);
+	const __m256i bias = _mm256_set1_epi16(127);
+	const __m256i one = _mm256_set1_epi16(1);
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i p, half[2], v;
+	size_t i;
+	int h;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		p = _mm256_loadu_si256((const __m256i *)(src + i * 4));
+		half[0] = _mm256_unpacklo_epi8(p, zero);
+		half[1] = _mm256_unpackhi_epi8(p, zero);
+		for (h = 0; h < 2; h++) {
+			v = _mm256_add_epi16(_mm256_mullo_epi16(half[h],
+					_mm256_shuffle_epi8(half[h], alpha)), bias);
+			v = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(v, one),
+					_mm256_srli_epi16(v, 8)), 8);
+			v = _mm256_blendv_epi8(v, half[h], alpha_lane);
+			half[h] = _mm256_shuffle_epi8(v, reverse);
+		}
+		/* Unpacking and packing both work within 128-bit lanes */
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_packus_epi16(half[0], half[1]));
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+static size_t fill_avx2(uint32_t *dst, uint32_t value, size_t n) {
+	const __m256i v = _mm256_set1_epi32((int)value);
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8)
+		_mm256_storeu_si256((__m256i *)(dst + i), v);
+	return i;
+}
+#endif /* PIXEL_X86 */
+
+#ifdef PIXEL_NEON
+static size_t swizzle_neon(unsigned char *dst, const unsigned char *src, size_t n) {
+	uint8x16x4_t p;
+	uint8x16_t t;
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		p = vld4q_u8(src + i * 4);
+		t = p.val[0];
+		p.val[0] = p.val[2];
+		p.val[2] = t;
+		vst4q_u8(dst + i * 4, p);
+	}
+	return i;
+}
+
+static inline uint8x8_t premultiply_neon_channel(uint8x8_t c, uint8x8_t a) {
+	uint16x8_t v = vaddq_u16(vmull_u8(c, a), vdupq_n_u16(127));
+
+	v = vaddq_u16(vaddq_u16(v, vdupq_n_u16(1)), vshrq_n_u16(v, 8));
+	return vshrn_n_u16(v, 8);
+}
+
+static size_t premultiply_neon(uint32_t *dst, const unsigned char *src, size_t n) {
+	uint8x8x4_t p, q;
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		p = vld4_u8(src + i * 4); /* a, r, g, b */
+		q.val[0] = premultiply_neon_channel(p.val[3], p.val[0]);
+		q.val[1] = premultiply_neon_channel(p.val[2], p.val[0]);
+		q.val[2] = premultiply_neon_channel(p.val[1], p.val[0]);
+		q.val[3] = p.val[0];
+		vst4_u8((unsigned char *)(dst + i), q);
+	}
+	return i;
+}
+
+static size_t fill_neon(uint32_t *dst, uint32_t value, size_t n) {
+	const uint32x4_t v = vdupq_n_u32(value);
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4)
+		vst1q_u32(dst + i, v);
+	return i;
+}
+#endif /* PIXEL_NEON */
+
+void pixel_swizzle(unsigned char *dst, const unsigned char *src, size_t n) {
+	size_t done = 0;
+
+#if defined(PIXEL_X86)
+	if (__builtin_cpu_supports("avx2"))
+		done = swizzle_avx2(dst, src, n);
+	else
+		done = swizzle_sse2(dst, src, n);
+#elif defined(PIXEL_NEON)
+	done = swizzle_neon(dst, src, n);
+#endif
+	swizzle_scalar(dst + done * 4, src + done * 4, n - done);
+}
+
+void pixel_swizzle_flip(unsigned char *dst, size_t dst_stride,
+		const unsigned char *src, size_t src_stride, int width, int height) {
+	int y;
+
+	for (y = 0; y < height; y++)
+		pixel_swizzle(dst + (size_t)y * dst_stride,
+				src + (size_t)(height - 1 - y) * src_stride, (size_t)width);
+}
+
+void pixel_premultiply_argb(uint32_t *dst, const unsigned char *src, size_t n) {
+	size_t done = 0;
+
+#if defined(PIXEL_X86)
+	if (__builtin_cpu_supports("avx2"))
+		done = premultiply_avx2(dst, src, n);
+	else
+		done = premultiply_sse2(dst, src, n);
+#elif defined(PIXEL_NEON)
+	done = premultiply_neon(dst, src, n);
+#endif
+	premultiply_scalar(dst + done, src + done * 4, n - done);
+}
+
+void pixel_fill(uint32_t *dst, uint32_t value, size_t n) {
+	size_t done = 0;
+
+#if defined(PIXEL_X86)
+	if (__builtin_cpu_supports("avx2"))
+		done = fill_avx2(dst, value, n);
+	else
+		done = fill_sse2(dst, value, n);
+#elif defined(PIXEL_NEON)
+	done = fill_neon(dst, value, n);
+#endif
+	fill_scalar(dst + done, value, n - done);
+}
@@ -0,0 +1,29 @@
+/* pixel.h - pixel format kernels shared by wallpapers and the tray */
+#ifndef PIXEL_H
+#define PIXEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Each kernel picks an SSE2, AVX2 or NEON version at runtime and falls
+ * back to a scalar loop that the vector versions match bit for bit.
+ */
+
+/* Swap bytes 0 and 2 of n 4-byte pixels, RGBA to BGRA or back.
+ * dst may be the same as src. */
+void pixel_swizzle(unsigned char *dst, const unsigned char *src, size_t n);
+
+/* Swizzle a width x height image, writing its rows in reverse order, as
+ * needed for pixels read back from GL */
+void pixel_swizzle_flip(unsigned char *dst, size_t dst_stride,
+		const unsigned char *src, size_t src_stride, int width, int height);
+
+/* Convert n straight-alpha pixels stored as A, R, G, B bytes to
+ * premultiplied native-endian ARGB32 */
+void pixel_premultiply_argb(uint32_t *dst, const unsigned char *src, size_t n);
+
+/* Set n 32-bit pixels to value */
+void pixel_fill(uint32_t *dst, uint32_t value, size_t n);
+
+#endif /* PIXEL_H */
@@ -0,0 +1,458 @@
+/* resample.c - separable image resampling for wallpapers
+ *
+ * Scaling is done in two passes: a horizontal pass over each source row
+ * the output needs, then a vertical pass that also swizzles RGBA to BGRA.
+ * Filter weights are computed once per output column and per output row
+ * as 14-bit fixed point, so the inner loops are integer multiply-adds.
+ * Horizontally filtered rows live in a small ring that only holds the
+ * rows of the current vertical window.
+ */
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __x86_64__
+#define RESAMPLE_X86
+#include <immintrin.h>
+#endif
+
+#include "resample.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define PRECISION_BITS 14
+
+typedef struct {
+	double support;
+	double (*fn)(double x);
+} Filter;
+
+/* Per-output-pixel filter taps */
+typedef struct {
+	int *bounds;      /* first source index and tap count, per output pixel */
+	int16_t *weights; /* ksize fixed-point weights, per output pixel */
+	int ksize;
+} Coeffs;
+
+typedef void (*HPassFn)(const unsigned char *src, unsigned char *dst,
+		int width, const Coeffs *c);
+typedef void (*VPassFn)(const unsigned char **rows, unsigned char *dst,
+		int width, const int16_t *w, int n);
+
+static double box_filter(double x) {
+	if (x > -0.5 && x <= 0.5)
+		return 1.0;
+	return 0.0;
+}
+
+static double bilinear_filter(double x) {
+	if (x < 0.0)
+		x = -x;
+	if (x < 1.0)
+		return 1.0 - x;
+	return 0.0;
+}
+
+static double sinc(double x) {
+	if (x == 0.0)
+		return 1.0;
+	x *= M_PI;
+	return sin(x) / x;
+}
+
+static double lanczos3_filter(double x) {
+	if (x > -3.0 && x < 3.0)
+		return sinc(x) * sinc(x / 3.0);
+	return 0.0;
+}
+
+static const Filter filters[] = {
+	[RESAMPLE_BOX]      = { 0.5, box_filter },
+	[RESAMPLE_BILINEAR] = { 1.0, bilinear_filter },
+	[RESAMPLE_LANCZOS3] = { 3.0, lanczos3_filter },
+};
+
+static void free_coeffs(Coeffs *c) {
+	free(c->bounds);
+	free(c->weights);
+	c->bounds = NULL;
+	c->weights = NULL;
+}
+
+/* Taps for out_count pixels starting at out_start of an image scaled from
+ * in_size to out_size. Downscaling widens the filter so every source pixel
+ * contributes. */
+static int compute_coeffs(Coeffs *c, const Filter *filter, int in_size,
+		int out_size, int out_start, int out_count) {
+	double scale = (double)in_size / out_size;
+	double filterscale = scale < 1.0 ? 1.0 : scale;
+	double support = filter->support * filterscale;
+	double *w;
+	int i, k;
+
+	c->ksize = (int)ceil(support) * 2 + 1;
+	c->bounds = malloc((size_t)out_count * 2 * sizeof(int));
+	c->weights = calloc((size_t)out_count * c->ksize, sizeof(int16_t));
+	w = malloc(c->ksize * sizeof(double));
+	if (!c->bounds || !c->weights || !w) {
+		free_coeffs(c);
+		free(w);
+		return 0;
+	}
+
+	for (i = 0; i < out_count; i++) {
+		double center = (out_start + i + 0.5) * scale;
+		double total = 0.0;
+		int xmin = (int)(center - support + 0.5);
+		int xmax = (int)(center + support + 0.5);
+		int count;
+
+		if (xmin < 0)
+			xmin = 0;
+		if (xmin > in_size - 1)
+			xmin = in_size - 1;
+		if (xmax > in_size)
+			xmax = in_size;
+		count = xmax - xmin;
+		if (count < 1)
+			count = 1;
+		if (count > c->ksize)
+			count = c->ksize;
+
+		for (k = 0; k < count; k++) {
+			w[k] = filter->fn((xmin + k - center + 0.5) / filterscale);
+			total += w[k];
+		}
+		for (k = 0; k < count; k++) {
+			double v = total != 0.0 ? w[k] / total : (k == 0);
+			c->weights[i * c->ksize + k] = (int16_t)lround(v * (1 << PRECISION_BITS));
+		}
+		c->bounds[i * 2] = xmin;
+		c->bounds[i * 2 + 1] = count;
+	}
+
+	free(w);
+	return 1;
+}
+
+static inline unsigned char clip8(int32_t v) {
+	v >>= PRECISION_BITS;
+	if (v < 0)
+		return 0;
+	if (v > 255)
+		return 255;
+	return (unsigned char)v;
+}
+
+/* Scalar reference kernels */
+static void hpass_scalar(const unsigned char *src, unsigned char *dst,
+		int width, const Coeffs *c) {
+	int x, k;
+
+	for (x = 0; x < width; x++) {
+		const int16_t *w = c->weights + x * c->ksize;
+		const unsigned char *s = src + c->bounds[x * 2] * 4;
+		int n = c->bounds[x * 2 + 1];
+		int32_t r, g, b, a;
+
+		r = g = b = a = 1 << (PRECISION_BITS - 1);
+		for (k = 0; k < n; k++, s += 4) {
+			r += s[0] * w[k];
+			g += s[1] * w[k];
+			b += s[2] * w[k];
+			a += s[3] * w[k];
+		}
+		dst[x * 4 + 0] = clip8(r);
+		dst[x * 4 + 1] = clip8(g);
+		dst[x * 4 + 2] = clip8(b);
+		dst[x * 4 + 3] = clip8(a);
+	}
+}
+
+static void vpass_scalar(const unsigned char **rows, unsigned char *dst,
+		int width, const int16_t *w, int n) {
+	int x, k;
+
+	for (x = 0; x < width; x++) {
+		int32_t r, g, b, a;
+
+		r = g = b = a = 1 << (PRECISION_BITS - 1);
+		for (k = 0; k < n; k++) {
+			const unsigned char *s = rows[k] + x * 4;
+			r += s[0] * w[k];
+			g += s[1] * w[k];
+			b += s[2] * w[k];
+			a += s[3] * w[k];
+		}
+		/* RGBA in, BGRA out */
+		dst[x * 4 + 0] = clip8(b);
+		dst[x * 4 + 1] = clip8(g);
+		dst[x * 4 + 2] = clip8(r);
+		dst[x * 4 + 3] = clip8(a);
+	}
+}
+
+#ifdef RESAMPLE_X86
+/* Two 16-bit weights packed for _mm_madd_epi16 against interleaved taps */
+static inline int32_t weight_pair(int16_t w0, int16_t w1) {
+	return (int32_t)((uint32_t)(uint16_t)w0 | ((uint32_t)(uint16_t)w1 << 16));
+}
+
+/* Accumulate taps k..n-1 of one output pixel, two at a time */
+static inline __m128i htaps_sse2(__m128i acc, const unsigned char *s,
+		const int16_t *w, int k, int n) {
+	const __m128i zero = _mm_setzero_si128();
+	__m128i pix;
+	int32_t v;
+
+	for (; k + 1 < n; k += 2) {
+		pix = _mm_loadl_epi64((const __m128i *)(s + k * 4));
+		pix = _mm_unpacklo_epi8(pix, zero);
+		/* r0 r1 g0 g1 b0 b1 a0 a1 */
+		pix = _mm_unpacklo_epi16(pix, _mm_srli_si128(pix, 8));
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(pix,
+				_mm_set1_epi32(weight_pair(w[k], w[k + 1]))));
+	}
+	if (k < n) {
+		memcpy(&v, s + k * 4, 4);
+		pix = _mm_unpacklo_epi8(_mm_cvtsi32_si128(v), zero);
+		pix = _mm_unpacklo_epi16(pix, zero);
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(pix,
+				_mm_set1_epi32(weight_pair(w[k], 0))));
+	}
+	return acc;
+}
+
+static inline void store_pixel_sse2(unsigned char *dst, __m128i acc) {
+	int32_t v;
+
+	acc = _mm_srai_epi32(acc, PRECISION_BITS);
+	acc = _mm_packs_epi32(acc, acc);
+	acc = _mm_packus_epi16(acc, acc);
+	v = _mm_cvtsi128_si32(acc);
+	memcpy(dst, &v, 4);
+}
+
+static void hpass_sse2(const unsigned char *src, unsigned char *dst,
+		int width, const Coeffs *c) {
+	const __m128i round = _mm_set1_epi32(1 << (PRECISION_BITS - 1));
+	int x;
+
+	for (x = 0; x < width; x++) {
+		const int16_t *w = c->weights + x * c->ksize;
+		const unsigned char *s = src + c->bounds[x * 2] * 4;
+
+		store_pixel_sse2(dst + x * 4,
+				htaps_sse2(round, s, w, 0, c->bounds[x * 2 + 1]));
+	}
+}
+
+static void vpass_sse2(const unsigned char **rows, unsigned char *dst,
+		int width, const int16_t *w, int n) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i round = _mm_set1_epi32(1 << (PRECISION_BITS - 1));
+	int x, k;
+
+	for (x = 0; x + 4 <= width; x += 4) {
+		__m128i acc0 = round, acc1 = round, acc2 = round, acc3 = round;
+		__m128i r0, r1, lo0, lo1, hi0, hi1, wv, p0, p1;
+
+		for (k = 0; k < n; k += 2) {
+			r0 = _mm_loadu_si128((const __m128i *)(rows[k] + x * 4));
+			if (k + 1 < n) {
+				r1 = _mm_loadu_si128((const __m128i *)(rows[k + 1] + x * 4));
+				wv = _mm_set1_epi32(weight_pair(w[k], w[k + 1]));
+			} else {
+				r1 = zero;
+				wv = _mm_set1_epi32(weight_pair(w[k], 0));
+			}
+			lo0 = _mm_unpacklo_epi8(r0, zero);
+			lo1 = _mm_unpacklo_epi8(r1, zero);
+			hi0 = _mm_unpackhi_epi8(r0, zero);
+			hi1 = _mm_unpackhi_epi8(r1, zero);
+			acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi16(lo0, lo1), wv));
+			acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi16(lo0, lo1), wv));
+			acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(_mm_unpacklo_epi16(hi0, hi1), wv));
+			acc3 = _mm_add_epi32(acc3, _mm_madd_epi16(_mm_unpackhi_epi16(hi0, hi1), wv));
+		}
+
+		p0 = _mm_packs_epi32(_mm_srai_epi32(acc0, PRECISION_BITS),
+				_mm_srai_epi32(acc1, PRECISION_BITS));
+		p1 = _mm_packs_epi32(_mm_srai_epi32(acc2, PRECISION_BITS),
+				_mm_srai_epi32(acc3, PRECISION_BITS));
+		/* RGBA -> BGRA on the 16-bit lanes */
+		p0 = _mm_shufflehi_epi16(_mm_shufflelo_epi16(p0, _MM_SHUFFLE(3, 0, 1, 2)), _MM_SHUFFLE(3, 0, 1, 2));
+		p1 = _mm_shufflehi_epi16(_mm_shufflelo_epi16(p1, _MM_SHUFFLE(3, 0, 1, 2)), _MM_SHUFFLE(3, 0, 1, 2));
+		_mm_storeu_si128((__m128i *)(dst + x * 4), _mm_packus_epi16(p0, p1));
+	}
+
+	if (x < width) {
+		const unsigned char *tail[n];
+
+		for (k = 0; k < n; k++)
+			tail[k] = rows[k] + x * 4;
+		vpass_scalar(tail, dst + x * 4, width - x, w, n);
+	}
+}
+
+__attribute__((target("avx2")))
+static void hpass_avx2(const unsigned char *src, unsigned char *dst,
+		int width, const Coeffs *c) {
+	/* Interleave the two pixels of each 128-bit lane: r0 r1 g0 g1 ... */
+	const __m256i shuf = _mm256_setr_epi8(
+			0, 1, 8, 9, 2, 3, 10, 11, 4, 5, 12, 13, 6, 7, 14, 15,
+			0, 1, 8, 9, 2, 3, 10, 11, 4, 5, 12, 13, 6, 7, 14, 15);
+	const __m128i round = _mm_set1_epi32(1 << (PRECISION_BITS - 1));
+	int x, k;
+
+	for (x = 0; x < width; x++) {
+		const int16_t *w = c->weights + x * c->ksize;
+		const unsigned char *s = src + c->bounds[x * 2] * 4;
+		int n = c->bounds[x * 2 + 1];
+		__m256i acc = _mm256_setzero_si256();
+		__m128i sum;
+
+		for (k = 0; k + 3 < n; k += 4) {
+			__m256i pix = _mm256_cvtepu8_epi16(
+					_mm_loadu_si128((const __m128i *)(s + k * 4)));
+			__m256i wv = _mm256_setr_epi32(
+					weight_pair(w[k], w[k + 1]), weight_pair(w[k], w[k + 1]),
+					weight_pair(w[k], w[k + 1]), weight_pair(w[k], w[k + 1]),
+					weight_pair(w[k + 2], w[k + 3]), weight_pair(w[k + 2], w[k + 3]),
+					weight_pair(w[k + 2], w[k + 3]), weight_pair(w[k + 2], w[k + 3]));
+
+			pix = _mm256_shuffle_epi8(pix, shuf);
+			acc = _mm256_add_epi32(acc, _mm256_madd_epi16(pix, wv));
+		}
+
+		sum = _mm_add_epi32(_mm256_castsi256_si128(acc),
+				_mm256_extracti128_si256(acc, 1));
+		sum = _mm_add_epi32(sum, round);
+		store_pixel_sse2(dst + x * 4, htaps_sse2(sum, s, w, k, n));
+	}
+}
+
+__attribute__((target("avx2")))
+static void vpass_avx2(const unsigned char **rows, unsigned char *dst,
+		int width, const int16_t *w, int n) {
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i round = _mm256_set1_epi32(1 << (PRECISION_BITS - 1));
+	int x, k;
+
+	/* 128-bit lanes stay independent through unpack/madd/pack, so the
+	 * eight pixels come out in order */
+	for (x = 0; x + 8 <= width; x += 8) {
+		__m256i acc0 = round, acc1 = round, acc2 = round, acc3 = round;
+		__m256i r0, r1, lo0, lo1, hi0, hi1, wv, p0, p1;
+
+		for (k = 0; k < n; k += 2) {
+			r0 = _mm256_loadu_si256((const __m256i *)(rows[k] + x * 4));
+			if (k + 1 < n) {
+				r1 = _mm256_loadu_si256((const __m256i *)(rows[k + 1] + x * 4));
+				wv = _mm256_set1_epi32(weight_pair(w[k], w[k + 1]));
+			} else {
+				r1 = zero;
+				wv = _mm256_set1_epi32(weight_pair(w[k], 0));
+			}
+			lo0 = _mm256_unpacklo_epi8(r0, zero);
+			lo1 = _mm256_unpacklo_epi8(r1, zero);
+			hi0 = _mm256_unpackhi_epi8(r0, zero);
+			hi1 = _mm256_unpackhi_epi8(r1, zero);
+			acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(_mm256_unpacklo_epi16(lo0, lo1), wv));
+			acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(_mm256_unpackhi_epi16(lo0, lo1), wv));
+			acc2 = _mm256_add_epi32(acc2, _mm256_madd_epi16(_mm256_unpacklo_epi16(hi0, hi1), wv));
+			acc3 = _mm256_add_epi32(acc3, _mm256_madd_epi16(_mm256_unpackhi_epi16(hi0, hi1), wv));
+		}
+
+		p0 = _mm256_packs_epi32(_mm256_srai_epi32(acc0, PRECISION_BITS),
+				_mm256_srai_epi32(acc1, PRECISION_BITS));
+		p1 = _mm256_packs_epi32(_mm256_srai_epi32(acc2, PRECISION_BITS),
+				_mm256_srai_epi32(acc3, PRECISION_BITS));
+		p0 = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(p0, _MM_SHUFFLE(3, 0, 1, 2)), _MM_SHUFFLE(3, 0, 1, 2));
+		p1 = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(p1, _MM_SHUFFLE(3, 0, 1, 2)), _MM_SHUFFLE(3, 0, 1, 2));
+		_mm256_storeu_si256((__m256i *)(dst + x * 4), _mm256_packus_epi16(p0, p1));
+	}
+
+	if (x < width) {
+		const unsigned char *tail[n];
+
+		for (k = 0; k < n; k++)
+			tail[k] = rows[k] + x * 4;
+		vpass_sse2(tail, dst + x * 4, width - x, w, n);
+	}
+}
+#endif /* RESAMPLE_X86 */
+
+int resample_rgba_to_bgra(const unsigned char *src, int src_w, int src_h,
+		int out_w, int out_h, int out_x, int out_y,
+		unsigned char *dst, int dst_w, int dst_h, size_t dst_stride,
+		int filter) {
+	const Filter *f;
+	Coeffs hc = {0}, vc = {0};
+	HPassFn hpass = hpass_scalar;
+	VPassFn vpass = vpass_scalar;
+	const unsigned char **rows;
+	unsigned char *ring;
+	size_t row_bytes = (size_t)dst_w * 4;
+	int next_row = 0;
+	int y, k;
+
+	if (dst_w <= 0 || dst_h <= 0 || src_w <= 0 || src_h <= 0)
+		return 1;
+
+	if (filter < RESAMPLE_BOX || filter > RESAMPLE_LANCZOS3)
+		filter = RESAMPLE_LANCZOS3;
+	f = &filters[filter];
+
+#ifdef RESAMPLE_X86
+	if (__builtin_cpu_supports("avx2")) {
+		hpass = hpass_avx2;
+		vpass = vpass_avx2;
+	} else {
+		hpass = hpass_sse2;
+		vpass = vpass_sse2;
+	}
+#endif
+
+	if (!compute_coeffs(&hc, f, src_w, out_w, out_x, dst_w))
+		return 0;
+	if (!compute_coeffs(&vc, f, src_h, out_h, out_y, dst_h)) {
+		free_coeffs(&hc);
+		return 0;
+	}
+
+	/* Ring of horizontally filtered rows, indexed by source row % ksize */
+	ring = malloc(row_bytes * vc.ksize);
+	rows = malloc(vc.ksize * sizeof(*rows));
+	if (!ring || !rows) {
+		free(ring);
+		free(rows);
+		free_coeffs(&hc);
+		free_coeffs(&vc);
+		return 0;
+	}
+
+	for (y = 0; y < dst_h; y++) {
+		int first = vc.bounds[y * 2];
+		int n = vc.bounds[y * 2 + 1];
+
+		if (next_row < first)
+			next_row = first;
+		for (; next_row < first + n; next_row++)
+			hpass(src + (size_t)next_row * src_w * 4,
+					ring + (next_row % vc.ksize) * row_bytes, dst_w, &hc);
+
+		for (k = 0; k < n; k++)
+			rows[k] = ring + ((first + k) % vc.ksize) * row_bytes;
+		vpass(rows, dst + y * dst_stride, dst_w, vc.weights + y * vc.ksize, n);
+	}
+
+	free(ring);
+	free(rows);
+	free_coeffs(&hc);
+	free_coeffs(&vc);
+	return 1;
+}
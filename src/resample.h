@@ -0,0 +1,25 @@
+/* resample.h - separable image resampling for wallpapers */
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include <stddef.h>
+
+/* Resampling filters, same values as the WallpaperFilter* config enum */
+enum {
+	RESAMPLE_BOX,      /* Average of covered source pixels */
+	RESAMPLE_BILINEAR, /* Triangle filter */
+	RESAMPLE_LANCZOS3, /* Windowed sinc, 3 lobes */
+};
+
+/*
+ * Scale an RGBA image to out_w x out_h and write the window of that scaled
+ * image starting at (out_x, out_y) with size dst_w x dst_h into dst as BGRA.
+ * The window must lie inside the scaled image.
+ * Returns 0 if scratch memory could not be allocated.
+ */
+int resample_rgba_to_bgra(const unsigned char *src, int src_w, int src_h,
+		int out_w, int out_h, int out_x, int out_y,
+		unsigned char *dst, int dst_w, int dst_h, size_t dst_stride,
+		int filter);
+
+#endif /* RESAMPLE_H */
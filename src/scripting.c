@@ -1,10 +1,15 @@
 /* scripting.c - Wren scripting support for dwl */
 #ifdef SCRIPTING
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <strings.h>
 #include <wordexp.h>
+#include <wayland-server-core.h>
+#include <xkbcommon/xkbcommon.h>
 
 #include "../wren/src/include/wren.h"
 #include "scripting.h"
@@ -27,6 +32,11 @@ extern void script_togglefloating(void);
 extern void script_togglefullscreen(void);
 extern void script_focusmon(int dir);
 extern void script_tagmon(int dir);
+extern const char *script_client_title(void *client);
+extern const char *script_client_appid(void *client);
+extern unsigned int script_client_tags(void *client);
+extern const char *script_monitor_name(void *monitor);
+extern unsigned int script_monitor_tags(void *monitor);
 
 /* Wallpaper functions from wallpaper.c */
 extern void wallpaper_disable(void);
@@ -40,6 +50,11 @@ extern void wallpaper_prev_dir(void);
 /* Global VM instance */
 static WrenVM *vm = NULL;
 
+/* Handles for calling a Fn with 0, 1 and 2 arguments, made once per VM
+ * so hooks and key callbacks neither allocate nor look up the signature */
+static const char *call_signatures[] = { "call()", "call(_)", "call(_,_)" };
+static WrenHandle *call_handles[3] = {0};
+
 /* Config path */
 #define CONFIG_PATH "~/.config/dwl/init.wren"
 
@@ -186,6 +201,172 @@ static void wp_prevDir(WrenVM *vm) {
 	wallpaper_prev_dir();
 }
 
+/* ============================================================
+ * Client and Monitor classes - hook payloads
+ * ============================================================ */
+
+enum { OBJECT_CLIENT, OBJECT_MONITOR };
+
+/* A client or monitor a hook has been queued for. Entries are made
+ * without touching the VM, from inside dwl's handlers, and each gets one
+ * foreign object when its first hook runs, so later hooks pass it without
+ * allocating. */
+typedef struct {
+	int kind;
+	void *ptr;            /* NULL once destroyed */
+	unsigned int id;      /* 0 when the entry is free */
+	WrenHandle *handle;   /* NULL until a hook has been given it */
+	/* Copied when destroyed, for the hooks that run after */
+	char *name;           /* Client title or Monitor name */
+	char *app_id;
+	unsigned int tags;
+} ScriptObject;
+
+/* Contents of a foreign Client or Monitor, and how queued events refer
+ * to one. An id of 0 is null. */
+typedef struct {
+	int index;
+	unsigned int id;
+} ScriptRef;
+
+static const ScriptRef no_object = { -1, 0 };
+
+static ScriptObject *objects = NULL;
+static int object_count = 0;
+static int object_cap = 0;
+static unsigned int next_object_id = 1;
+
+/* A linear scan is enough: the table only holds live clients and
+ * monitors, and destroyed ones until their destroy hook has run */
+static int find_object(int kind, void *ptr) {
+	for (int i = 0; i < object_count; i++) {
+		if (objects[i].id && objects[i].ptr == ptr && objects[i].kind == kind)
+			return i;
+	}
+	return -1;
+}
+
+/* Reference to ptr's entry, made on first use, null for NULL or when
+ * out of memory. Safe to call while Wren is running. */
+static ScriptRef object_ref(int kind, void *ptr) {
+	if (!ptr)
+		return no_object;
+
+	int i = find_object(kind, ptr);
+	if (i >= 0)
+		return (ScriptRef){ i, objects[i].id };
+
+	for (i = 0; i < object_count && objects[i].id; i++)
+		;
+	if (i == object_count) {
+		if (object_count == object_cap) {
+			int cap = object_cap ? object_cap * 2 : 32;
+			ScriptObject *grown = realloc(objects, cap * sizeof(*grown));
+			if (!grown)
+				return no_object;
+			objects = grown;
+			object_cap = cap;
+		}
+		object_count++;
+	}
+
+	objects[i] = (ScriptObject){ .kind = kind, .ptr = ptr, .id = next_object_id++ };
+	return (ScriptRef){ i, objects[i].id };
+}
+
+/* Entry ref refers to, NULL once it has been freed. Its ptr is NULL from
+ * when the client or monitor is destroyed until then. */
+static ScriptObject *ref_object(const ScriptRef *ref) {
+	if (ref->id && ref->index >= 0 && ref->index < object_count
+			&& objects[ref->index].id == ref->id)
+		return &objects[ref->index];
+	return NULL;
+}
+
+static bool ref_alive(const ScriptRef *ref) {
+	ScriptObject *o = ref_object(ref);
+	return o && o->ptr;
+}
+
+/* Foreign object for ref, made on first use. Uses slot 0, so only call
+ * it between hooks. */
+static WrenHandle *object_handle(const ScriptRef *ref) {
+	ScriptObject *o = ref_object(ref);
+	if (!o)
+		return NULL;
+	if (o->handle)
+		return o->handle;
+
+	wrenEnsureSlots(vm, 1);
+	wrenGetVariable(vm, "main", o->kind == OBJECT_CLIENT ? "Client" : "Monitor", 0);
+	ScriptRef *foreign = wrenSetSlotNewForeign(vm, 0, 0, sizeof(*foreign));
+	*foreign = *ref;
+	o->handle = wrenGetSlotHandle(vm, 0);
+	return o->handle;
+}
+
+/* Entry the receiver refers to */
+static ScriptObject *object_entry(WrenVM *vm) {
+	return ref_object(wrenGetSlotForeign(vm, 0));
+}
+
+static void free_object(int i) {
+	if (objects[i].handle)
+		wrenReleaseHandle(vm, objects[i].handle);
+	free(objects[i].name);
+	free(objects[i].app_id);
+	objects[i] = (ScriptObject){0};
+}
+
+static void set_slot_string_or_null(WrenVM *vm, const char *str) {
+	if (str)
+		wrenSetSlotString(vm, 0, str);
+	else
+		wrenSetSlotNull(vm, 0);
+}
+
+static void object_id(WrenVM *vm) {
+	ScriptRef *ref = wrenGetSlotForeign(vm, 0);
+	wrenSetSlotDouble(vm, 0, ref->id);
+}
+
+static void object_isAlive(WrenVM *vm) {
+	wrenSetSlotBool(vm, 0, ref_alive(wrenGetSlotForeign(vm, 0)));
+}
+
+/* Getters read the client or monitor while it is alive, then what it
+ * had when destroyed */
+static void client_title(WrenVM *vm) {
+	ScriptObject *o = object_entry(vm);
+	set_slot_string_or_null(vm, !o ? NULL : o->ptr ? script_client_title(o->ptr) : o->name);
+}
+
+static void client_appId(WrenVM *vm) {
+	ScriptObject *o = object_entry(vm);
+	set_slot_string_or_null(vm, !o ? NULL : o->ptr ? script_client_appid(o->ptr) : o->app_id);
+}
+
+static void client_tags(WrenVM *vm) {
+	ScriptObject *o = object_entry(vm);
+	if (o)
+		wrenSetSlotDouble(vm, 0, o->ptr ? script_client_tags(o->ptr) : o->tags);
+	else
+		wrenSetSlotNull(vm, 0);
+}
+
+static void monitor_name(WrenVM *vm) {
+	ScriptObject *o = object_entry(vm);
+	set_slot_string_or_null(vm, !o ? NULL : o->ptr ? script_monitor_name(o->ptr) : o->name);
+}
+
+static void monitor_tags(WrenVM *vm) {
+	ScriptObject *o = object_entry(vm);
+	if (o)
+		wrenSetSlotDouble(vm, 0, o->ptr ? script_monitor_tags(o->ptr) : o->tags);
+	else
+		wrenSetSlotNull(vm, 0);
+}
+
 /* ============================================================
  * Hooks class - event callbacks
  * ============================================================ */
@@ -211,6 +392,15 @@ enum {
 	HOOK_COUNT
 };
 
+/* Execution budget per call, in Wren calls and loop iterations. A hook
+ * or key binding that runs out MAX_STRIKES times is dropped. */
+#define DEFAULT_BUDGET 1000000
+#define MAX_STRIKES 3
+
+/* Budgets per hook, with the one for key bindings last */
+static int hook_budgets[HOOK_COUNT + 1];
+static int hook_strikes[HOOK_COUNT];
+
 static void hooks_on(WrenVM *vm) {
 	const char *event = wrenGetSlotString(vm, 1);
 
@@ -219,78 +409,497 @@ static void hooks_on(WrenVM *vm) {
 			if (hook_handles[i])
 				wrenReleaseHandle(vm, hook_handles[i]);
 			hook_handles[i] = wrenGetSlotHandle(vm, 2);
+			hook_strikes[i] = 0;
+			return;
+		}
+	}
+	fprintf(stderr, "[wren] Unknown hook: %s\n", event);
+}
+
+/* Hooks.setBudget(event, steps), "key" for key bindings and 0 for none */
+static void hooks_setBudget(WrenVM *vm) {
+	const char *event = wrenGetSlotString(vm, 1);
+	double steps = wrenGetSlotDouble(vm, 2);
+	int budget = steps <= 0 ? 0 : steps >= INT_MAX ? INT_MAX : (int)steps;
+
+	if (strcmp(event, "key") == 0) {
+		hook_budgets[HOOK_COUNT] = budget;
+		return;
+	}
+	for (int i = 0; hook_names[i]; i++) {
+		if (strcmp(event, hook_names[i]) == 0) {
+			hook_budgets[i] = budget;
 			return;
 		}
 	}
 	fprintf(stderr, "[wren] Unknown hook: %s\n", event);
 }
 
+/* Number of wrenCall and wrenInterpret calls running. Wren cannot be
+ * entered again from a foreign method, so events triggered by one wait
+ * until it returns. */
+static int wren_depth = 0;
+
+static void wren_leave(void);
+
+/* Call the Fn in slot 0 within budget, true if it ran out. Wren aborts
+ * the call and reports it with a stack trace through wren_error. */
+static bool call_budgeted(WrenHandle *method, int budget) {
+	wrenSetBudget(vm, budget);
+	wren_depth++;
+	wrenCall(vm, method);
+	bool spent = wrenGetBudget(vm) < 0;
+	wrenSetBudget(vm, 0);
+	wren_leave();
+	return spent;
+}
+
+static void run_hook(int hook_id, int argc) {
+	if (!call_budgeted(call_handles[argc], hook_budgets[hook_id])
+			|| ++hook_strikes[hook_id] < MAX_STRIKES)
+		return;
+
+	fprintf(stderr, "[wren] Disabled %s hook after %d over-budget calls\n",
+	        hook_names[hook_id], MAX_STRIKES);
+	if (hook_handles[hook_id]) {
+		wrenReleaseHandle(vm, hook_handles[hook_id]);
+		hook_handles[hook_id] = NULL;
+	}
+	hook_strikes[hook_id] = 0;
+}
+
 static void call_hook(int hook_id) {
 	if (!vm || !hook_handles[hook_id])
 		return;
 
 	wrenEnsureSlots(vm, 1);
 	wrenSetSlotHandle(vm, 0, hook_handles[hook_id]);
-	wrenCall(vm, wrenMakeCallHandle(vm, "call()"));
+	run_hook(hook_id, 0);
+}
+
+/* Call a hook with argc objects, made first as they use slot 0 */
+static void call_hook_objects(int hook_id, int argc, const ScriptRef *refs) {
+	WrenHandle *args[2];
+
+	for (int i = 0; i < argc; i++)
+		args[i] = object_handle(&refs[i]);
+
+	wrenEnsureSlots(vm, argc + 1);
+	wrenSetSlotHandle(vm, 0, hook_handles[hook_id]);
+	for (int i = 0; i < argc; i++) {
+		if (args[i])
+			wrenSetSlotHandle(vm, i + 1, args[i]);
+		else
+			wrenSetSlotNull(vm, i + 1);
+	}
+	run_hook(hook_id, argc);
+}
+
+/* ============================================================
+ * Event queue - hooks run once dwl is idle
+ * ============================================================ */
+
+/* Hooks are queued from inside dwl's handlers and run from an idle
+ * callback, after the state change they report is complete. Only the
+ * last clientFocus, tagChange and layoutChange per monitor is kept. */
+#define EVENT_QUEUE_SIZE 64
+
+typedef struct {
+	int hook;             /* -1 to only release */
+	int argc;
+	ScriptRef args[2];
+	unsigned int tags;    /* tagChange */
+	int release;          /* Object to free afterwards, -1 for none */
+} ScriptEvent;
+
+static ScriptEvent event_queue[EVENT_QUEUE_SIZE];
+static int queue_head = 0;
+static int queue_len = 0;
+static bool draining = false;
+
+static struct wl_event_loop *event_loop = NULL;
+static struct wl_event_source *drain_idle = NULL;
+static struct wl_event_source *drain_timer = NULL;
+
+static ScriptEvent *queued_at(int pos) {
+	return &event_queue[(queue_head + pos) % EVENT_QUEUE_SIZE];
+}
+
+/* Position of a pending event for hook, and arg if given, -1 if none */
+static int find_queued(int hook, const ScriptRef *arg) {
+	for (int pos = 0; pos < queue_len; pos++) {
+		ScriptEvent *ev = queued_at(pos);
+		if (ev->hook == hook && (!arg || ev->args[0].id == arg->id))
+			return pos;
+	}
+	return -1;
+}
+
+static void unqueue(int pos) {
+	for (; pos < queue_len - 1; pos++)
+		*queued_at(pos) = *queued_at(pos + 1);
+	queue_len--;
+}
+
+/* Free ref's entry if nothing else will, for one made for an event that
+ * was then dropped. A live entry is kept once Wren has a foreign object
+ * for it, so the hooks keep seeing the same one. */
+static void forget_unused(const ScriptRef *ref) {
+	ScriptObject *o = ref_object(ref);
+	if (!o || (o->ptr && o->handle))
+		return;
+	for (int pos = 0; pos < queue_len; pos++) {
+		ScriptEvent *ev = queued_at(pos);
+		if (ev->args[0].id == ref->id || ev->args[1].id == ref->id)
+			return;
+	}
+	free_object(ref->index);
+}
+
+static void dispatch_event(ScriptEvent *ev) {
+	if (ev->hook == HOOK_TAG_CHANGE && hook_handles[ev->hook]) {
+		wrenEnsureSlots(vm, 2);
+		wrenSetSlotHandle(vm, 0, hook_handles[ev->hook]);
+		wrenSetSlotDouble(vm, 1, ev->tags);
+		run_hook(ev->hook, 1);
+	} else if (ev->hook >= 0 && hook_handles[ev->hook]) {
+		call_hook_objects(ev->hook, ev->argc, ev->args);
+	}
+
+	if (ev->release >= 0)
+		free_object(ev->release);
+}
+
+static int drain_timer_callback(void *data);
+
+/* Run the events queued so far. Ones queued by the hooks themselves wait
+ * for the next loop iteration, so scripts reacting to each other cannot
+ * keep dwl from dispatching. */
+static void drain_events(void) {
+	int n = queue_len;
+
+	draining = true;
+	while (n-- > 0 && queue_len > 0) {
+		ScriptEvent ev = *queued_at(0);
+		queue_head = (queue_head + 1) % EVENT_QUEUE_SIZE;
+		queue_len--;
+		dispatch_event(&ev);
+	}
+	draining = false;
+
+	if (queue_len > 0 && event_loop) {
+		if (!drain_timer)
+			drain_timer = wl_event_loop_add_timer(event_loop, drain_timer_callback, NULL);
+		if (drain_timer)
+			wl_event_source_timer_update(drain_timer, 1);
+	}
+}
+
+static void drain_idle_callback(void *data) {
+	drain_idle = NULL;
+	drain_events();
+}
+
+static int drain_timer_callback(void *data) {
+	drain_events();
+	return 0;
+}
+
+static void schedule_drain(void) {
+	if (draining || drain_idle)
+		return;
+	if (event_loop)
+		drain_idle = wl_event_loop_add_idle(event_loop, drain_idle_callback, NULL);
+	else if (!wren_depth)
+		drain_events();
+}
+
+/* Without an event loop, run what was queued while Wren was running */
+static void wren_leave(void) {
+	if (--wren_depth == 0 && queue_len > 0 && !event_loop && !draining)
+		drain_events();
+}
+
+/* Append an event for hook, NULL if the queue stays full */
+static ScriptEvent *queue_event(int hook) {
+	/* Outside a drain and Wren, a full queue runs now rather than losing
+	 * events */
+	if (queue_len == EVENT_QUEUE_SIZE && !draining && !wren_depth)
+		drain_events();
+	if (queue_len == EVENT_QUEUE_SIZE) {
+		fprintf(stderr, "[wren] Event queue full, dropping %s\n",
+		        hook >= 0 ? hook_names[hook] : "release");
+		return NULL;
+	}
+
+	ScriptEvent *ev = queued_at(queue_len++);
+	*ev = (ScriptEvent){ .hook = hook, .release = -1 };
+	return ev;
+}
+
+static void queue_hook(int hook_id, int argc, ScriptRef a, ScriptRef b) {
+	ScriptEvent *ev = queue_event(hook_id);
+	if (!ev) {
+		forget_unused(&a);
+		forget_unused(&b);
+		return;
+	}
+
+	ev->argc = argc;
+	ev->args[0] = a;
+	ev->args[1] = b;
+	schedule_drain();
+}
+
+static void queue_object_hook(int hook_id, int kind, void *ptr) {
+	if (!vm || !hook_handles[hook_id])
+		return;
+	queue_hook(hook_id, 1, object_ref(kind, ptr), no_object);
+}
+
+static char *strdup_or_null(const char *str) {
+	return str ? strdup(str) : NULL;
+}
+
+/* Queue ptr's destroy hook. It reads as dead from now on, with the values
+ * it has now, and its entry is freed once every event queued before has
+ * run. */
+static void queue_destroy_hook(int hook_id, int kind, void *ptr) {
+	if (!vm)
+		return;
+
+	int i = hook_handles[hook_id] ? object_ref(kind, ptr).index : find_object(kind, ptr);
+	if (i < 0)
+		return;
+	if (kind == OBJECT_CLIENT) {
+		objects[i].name = strdup_or_null(script_client_title(ptr));
+		objects[i].app_id = strdup_or_null(script_client_appid(ptr));
+		objects[i].tags = script_client_tags(ptr);
+	} else {
+		objects[i].name = strdup_or_null(script_monitor_name(ptr));
+		objects[i].tags = script_monitor_tags(ptr);
+	}
+	objects[i].ptr = NULL;
+
+	ScriptRef ref = { i, objects[i].id };
+	ScriptEvent *ev = queue_event(hook_handles[hook_id] ? hook_id : -1);
+	if (!ev) {
+		/* One still named by a queued event stays until scripting_cleanup */
+		forget_unused(&ref);
+		return;
+	}
+	ev->argc = 1;
+	ev->args[0] = ref;
+	ev->release = i;
+	schedule_drain();
 }
 
 /* ============================================================
  * Keys class - runtime keybinds
  * ============================================================ */
 
-/* Key binding storage */
-#define MAX_SCRIPT_KEYS 64
+/* Custom modifier for Right Alt, RALT_MOD in config.h */
+#define SCRIPT_RALT_MOD (1 << 20)
+
+static const struct {
+	const char *name;
+	unsigned int mod;
+} mod_names[] = {
+	{ "shift",   1 << 0 }, /* WLR_MODIFIER_SHIFT */
+	{ "ctrl",    1 << 2 }, /* WLR_MODIFIER_CTRL */
+	{ "control", 1 << 2 },
+	{ "alt",     1 << 3 }, /* WLR_MODIFIER_ALT */
+	{ "mod1",    1 << 3 },
+	{ "mod2",    1 << 4 }, /* WLR_MODIFIER_MOD2 */
+	{ "mod3",    1 << 5 }, /* WLR_MODIFIER_MOD3 */
+	{ "mod",     1 << 6 }, /* WLR_MODIFIER_LOGO */
+	{ "mod4",    1 << 6 },
+	{ "super",   1 << 6 },
+	{ "logo",    1 << 6 },
+	{ "mod5",    1 << 7 }, /* WLR_MODIFIER_MOD5 */
+	{ "ralt",    SCRIPT_RALT_MOD },
+};
 
+/* Key binding storage: open addressing with linear probing, keyed on
+ * (mod, keysym). Keysyms are stored lowercase, as dwl compares them. */
 typedef struct {
 	unsigned int mod;
-	unsigned int key;
-	WrenHandle *callback;
+	xkb_keysym_t sym;
+	WrenHandle *callback; /* NULL for an empty slot */
+	int strikes;
 } ScriptKey;
 
-static ScriptKey script_keys[MAX_SCRIPT_KEYS];
-static int script_key_count = 0;
+static ScriptKey *script_keys = NULL;
+static size_t script_key_cap = 0; /* power of two */
+static size_t script_key_count = 0;
+
+/* Parse modifiers like "mod+shift", false on an unknown name */
+static bool parse_mod(const char *mod_str, unsigned int *mod) {
+	*mod = 0;
+	while (*mod_str) {
+		size_t len = strcspn(mod_str, "+-| ");
+		bool found = len == 0 || (len == 4 && strncasecmp(mod_str, "none", 4) == 0);
+
+		for (size_t i = 0; !found && i < sizeof(mod_names) / sizeof(*mod_names); i++) {
+			if (strlen(mod_names[i].name) == len
+					&& strncasecmp(mod_str, mod_names[i].name, len) == 0) {
+				*mod |= mod_names[i].mod;
+				found = true;
+			}
+		}
+		if (!found)
+			return false;
+		mod_str += len;
+		if (*mod_str)
+			mod_str++;
+	}
+	return true;
+}
+
+/* Keysym for a name like "Return" or "F5", XKB_KEY_NoSymbol if unknown */
+static xkb_keysym_t parse_key(const char *key_str) {
+	xkb_keysym_t sym = xkb_keysym_from_name(key_str, XKB_KEYSYM_NO_FLAGS);
 
-static unsigned int parse_mod(const char *mod_str) {
-	unsigned int mod = 0;
-	if (strstr(mod_str, "mod") || strstr(mod_str, "super") || strstr(mod_str, "logo"))
-		mod |= (1 << 6); /* WLR_MODIFIER_LOGO */
-	if (strstr(mod_str, "shift"))
-		mod |= (1 << 0); /* WLR_MODIFIER_SHIFT */
-	if (strstr(mod_str, "ctrl") || strstr(mod_str, "control"))
-		mod |= (1 << 2); /* WLR_MODIFIER_CTRL */
-	if (strstr(mod_str, "alt"))
-		mod |= (1 << 3); /* WLR_MODIFIER_ALT */
-	return mod;
+	if (sym == XKB_KEY_NoSymbol)
+		sym = xkb_keysym_from_name(key_str, XKB_KEYSYM_CASE_INSENSITIVE);
+	return xkb_keysym_to_lower(sym);
 }
 
-static void keys_bind(WrenVM *vm) {
-	if (script_key_count >= MAX_SCRIPT_KEYS) {
-		fprintf(stderr, "[wren] Max keybinds reached\n");
-		return;
+static size_t key_hash(unsigned int mod, xkb_keysym_t sym) {
+	uint64_t h = ((uint64_t)mod << 32 | sym) * 0x9e3779b97f4a7c15ull;
+	return (size_t)(h >> 32) & (script_key_cap - 1);
+}
+
+/* Slot holding (mod, sym), or the empty slot it would go in */
+static size_t key_slot(unsigned int mod, xkb_keysym_t sym) {
+	size_t i = key_hash(mod, sym);
+
+	while (script_keys[i].callback
+			&& (script_keys[i].mod != mod || script_keys[i].sym != sym))
+		i = (i + 1) & (script_key_cap - 1);
+	return i;
+}
+
+static bool keys_grow(void) {
+	ScriptKey *old = script_keys;
+	size_t old_cap = script_key_cap;
+	size_t cap = old_cap ? old_cap * 2 : 64;
+	ScriptKey *keys = calloc(cap, sizeof(*keys));
+
+	if (!keys)
+		return false;
+	script_keys = keys;
+	script_key_cap = cap;
+	for (size_t i = 0; i < old_cap; i++) {
+		if (old[i].callback)
+			script_keys[key_slot(old[i].mod, old[i].sym)] = old[i];
+	}
+	free(old);
+	return true;
+}
+
+/* Empty slot i, moving later entries of its run back so no lookup
+ * stops early at the hole */
+static void keys_remove(size_t i) {
+	size_t mask = script_key_cap - 1;
+
+	wrenReleaseHandle(vm, script_keys[i].callback);
+	script_keys[i].callback = NULL;
+	script_key_count--;
+
+	for (size_t j = (i + 1) & mask; script_keys[j].callback; j = (j + 1) & mask) {
+		size_t home = key_hash(script_keys[j].mod, script_keys[j].sym);
+
+		/* j may fill the hole unless its home lies between the two */
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			script_keys[i] = script_keys[j];
+			script_keys[j].callback = NULL;
+			i = j;
+		}
 	}
+}
 
+/* Parse the mod and key in slots 1 and 2, false if either is unknown */
+static bool get_slot_key(WrenVM *vm, unsigned int *mod, xkb_keysym_t *sym) {
 	const char *mod_str = wrenGetSlotString(vm, 1);
 	const char *key_str = wrenGetSlotString(vm, 2);
 
-	ScriptKey *k = &script_keys[script_key_count++];
-	k->mod = parse_mod(mod_str);
-	k->key = key_str[0]; /* Simple: just use first char as keysym for now */
+	if (!parse_mod(mod_str, mod)) {
+		fprintf(stderr, "[wren] Unknown modifier: %s\n", mod_str);
+		return false;
+	}
+	if ((*sym = parse_key(key_str)) == XKB_KEY_NoSymbol) {
+		fprintf(stderr, "[wren] Unknown key: %s\n", key_str);
+		return false;
+	}
+	return true;
+}
+
+static void keys_bind(WrenVM *vm) {
+	unsigned int mod;
+	xkb_keysym_t sym;
+
+	if (!get_slot_key(vm, &mod, &sym))
+		return;
+
+	/* Keep the table at most half full */
+	if ((script_key_count + 1) * 2 > script_key_cap && !keys_grow()) {
+		fprintf(stderr, "[wren] Out of memory for keybinds\n");
+		return;
+	}
+
+	ScriptKey *k = &script_keys[key_slot(mod, sym)];
+	if (k->callback)
+		wrenReleaseHandle(vm, k->callback);
+	else
+		script_key_count++;
+	k->mod = mod;
+	k->sym = sym;
 	k->callback = wrenGetSlotHandle(vm, 3);
+	k->strikes = 0;
 
-	fprintf(stderr, "[wren] Bound key: %s+%s\n", mod_str, key_str);
+	fprintf(stderr, "[wren] Bound key: %s+%s\n",
+	        wrenGetSlotString(vm, 1), wrenGetSlotString(vm, 2));
+}
+
+static void keys_unbind(WrenVM *vm) {
+	unsigned int mod;
+	xkb_keysym_t sym;
+	bool found = false;
+
+	if (script_key_count && get_slot_key(vm, &mod, &sym)) {
+		size_t i = key_slot(mod, sym);
+		if ((found = script_keys[i].callback != NULL))
+			keys_remove(i);
+	}
+	wrenSetSlotBool(vm, 0, found);
 }
 
 /* Called from dwl's key handler to check script bindings */
 bool scripting_handle_key(unsigned int mod, unsigned int key) {
-	for (int i = 0; i < script_key_count; i++) {
-		if (script_keys[i].mod == mod && script_keys[i].key == key) {
-			wrenEnsureSlots(vm, 1);
-			wrenSetSlotHandle(vm, 0, script_keys[i].callback);
-			wrenCall(vm, wrenMakeCallHandle(vm, "call()"));
-			return true;
-		}
+	if (!vm || !script_key_count)
+		return false;
+
+	xkb_keysym_t sym = xkb_keysym_to_lower(key);
+	WrenHandle *callback = script_keys[key_slot(mod, sym)].callback;
+	if (!callback)
+		return false;
+
+	wrenEnsureSlots(vm, 1);
+	wrenSetSlotHandle(vm, 0, callback);
+	if (!call_budgeted(call_handles[0], hook_budgets[HOOK_COUNT]))
+		return true;
+
+	/* The callback may have changed bindings, so look it up again */
+	size_t i = key_slot(mod, sym);
+	if (script_keys[i].callback == callback && ++script_keys[i].strikes >= MAX_STRIKES) {
+		char name[64];
+		xkb_keysym_get_name(sym, name, sizeof(name));
+		fprintf(stderr, "[wren] Unbound key %s after %d over-budget calls\n",
+		        name, MAX_STRIKES);
+		keys_remove(i);
 	}
-	return false;
+	return true;
 }
 
 /* ============================================================
@@ -324,12 +933,29 @@ static WrenForeignMethodFn bind_foreign_method(WrenVM *vm, const char *module,
 		if (strcmp(signature, "log(_)") == 0) return dwl_log;
 	}
 
+	if (strcmp(className, "Client") == 0 && !isStatic) {
+		if (strcmp(signature, "id") == 0) return object_id;
+		if (strcmp(signature, "isAlive") == 0) return object_isAlive;
+		if (strcmp(signature, "title") == 0) return client_title;
+		if (strcmp(signature, "appId") == 0) return client_appId;
+		if (strcmp(signature, "tags") == 0) return client_tags;
+	}
+
+	if (strcmp(className, "Monitor") == 0 && !isStatic) {
+		if (strcmp(signature, "id") == 0) return object_id;
+		if (strcmp(signature, "isAlive") == 0) return object_isAlive;
+		if (strcmp(signature, "name") == 0) return monitor_name;
+		if (strcmp(signature, "tags") == 0) return monitor_tags;
+	}
+
 	if (strcmp(className, "Hooks") == 0) {
 		if (strcmp(signature, "on(_,_)") == 0) return hooks_on;
+		if (strcmp(signature, "setBudget(_,_)") == 0) return hooks_setBudget;
 	}
 
 	if (strcmp(className, "Keys") == 0) {
 		if (strcmp(signature, "bind(_,_,_)") == 0) return keys_bind;
+		if (strcmp(signature, "unbind(_,_)") == 0) return keys_unbind;
 	}
 
 	if (strcmp(className, "Wallpaper") == 0) {
@@ -371,12 +997,29 @@ static const char *prelude =
 	"  foreign static log(msg)\n"
 	"}\n"
 	"\n"
+	"foreign class Client {\n"
+	"  foreign id\n"
+	"  foreign isAlive\n"
+	"  foreign title\n"
+	"  foreign appId\n"
+	"  foreign tags\n"
+	"}\n"
+	"\n"
+	"foreign class Monitor {\n"
+	"  foreign id\n"
+	"  foreign isAlive\n"
+	"  foreign name\n"
+	"  foreign tags\n"
+	"}\n"
+	"\n"
 	"class Hooks {\n"
 	"  foreign static on(event, fn)\n"
+	"  foreign static setBudget(event, steps)\n"
 	"}\n"
 	"\n"
 	"class Keys {\n"
 	"  foreign static bind(mod, key, fn)\n"
+	"  foreign static unbind(mod, key)\n"
 	"}\n"
 	"\n"
 	"class Wallpaper {\n"
@@ -434,6 +1077,11 @@ bool scripting_init(void) {
 		fprintf(stderr, "[wren] Failed to create VM\n");
 		return false;
 	}
+	for (int i = 0; i < 3; i++)
+		call_handles[i] = wrenMakeCallHandle(vm, call_signatures[i]);
+	for (int i = 0; i <= HOOK_COUNT; i++)
+		hook_budgets[i] = DEFAULT_BUDGET;
+	memset(hook_strikes, 0, sizeof(hook_strikes));
 
 	/* Load prelude with class definitions */
 	WrenInterpretResult result = wrenInterpret(vm, "main", prelude);
@@ -449,8 +1097,7 @@ bool scripting_init(void) {
 		char *source = read_file(config_path);
 		if (source) {
 			fprintf(stderr, "[wren] Loading %s\n", config_path);
-			result = wrenInterpret(vm, "main", source);
-			if (result != WREN_RESULT_SUCCESS)
+			if (!scripting_eval(source))
 				fprintf(stderr, "[wren] Failed to load init script\n");
 			free(source);
 		}
@@ -472,38 +1119,128 @@ void scripting_cleanup(void) {
 	}
 
 	/* Release key callback handles */
-	for (int i = 0; i < script_key_count; i++) {
+	for (size_t i = 0; i < script_key_cap; i++) {
 		if (script_keys[i].callback)
 			wrenReleaseHandle(vm, script_keys[i].callback);
 	}
-	script_key_count = 0;
+	free(script_keys);
+	script_keys = NULL;
+	script_key_cap = script_key_count = 0;
+
+	/* Drop pending events, whose objects are released below */
+	queue_head = queue_len = 0;
+	if (drain_idle) {
+		wl_event_source_remove(drain_idle);
+		drain_idle = NULL;
+	}
+	if (drain_timer) {
+		wl_event_source_remove(drain_timer);
+		drain_timer = NULL;
+	}
+
+	/* Release client and monitor objects */
+	for (int i = 0; i < object_count; i++) {
+		if (objects[i].id)
+			free_object(i);
+	}
+	free(objects);
+	objects = NULL;
+	object_count = object_cap = 0;
+	next_object_id = 1;
+
+	for (int i = 0; i < 3; i++) {
+		wrenReleaseHandle(vm, call_handles[i]);
+		call_handles[i] = NULL;
+	}
 
 	wrenFreeVM(vm);
 	vm = NULL;
 }
 
+void scripting_set_event_loop(struct wl_event_loop *loop) {
+	event_loop = loop;
+}
+
 void scripting_hook(const char *hook_name) {
+	if (!vm)
+		return;
+
 	for (int i = 0; hook_names[i]; i++) {
 		if (strcmp(hook_name, hook_names[i]) == 0) {
-			call_hook(i);
+			if (hook_handles[i])
+				queue_hook(i, 0, no_object, no_object);
 			return;
 		}
 	}
 }
 
-void scripting_on_startup(void) { call_hook(HOOK_STARTUP); }
-void scripting_on_quit(void) { call_hook(HOOK_QUIT); }
-void scripting_on_client_create(void *client) { call_hook(HOOK_CLIENT_CREATE); }
-void scripting_on_client_destroy(void *client) { call_hook(HOOK_CLIENT_DESTROY); }
-void scripting_on_client_focus(void *client) { call_hook(HOOK_CLIENT_FOCUS); }
-void scripting_on_tag_change(unsigned int tags) { call_hook(HOOK_TAG_CHANGE); }
-void scripting_on_layout_change(void *monitor) { call_hook(HOOK_LAYOUT_CHANGE); }
-void scripting_on_monitor_connect(void *monitor) { call_hook(HOOK_MONITOR_CONNECT); }
-void scripting_on_monitor_disconnect(void *monitor) { call_hook(HOOK_MONITOR_DISCONNECT); }
+void scripting_on_startup(void) { scripting_hook("startup"); }
+void scripting_on_client_create(void *client) { queue_object_hook(HOOK_CLIENT_CREATE, OBJECT_CLIENT, client); }
+void scripting_on_client_destroy(void *client) { queue_destroy_hook(HOOK_CLIENT_DESTROY, OBJECT_CLIENT, client); }
+void scripting_on_monitor_connect(void *monitor) { queue_object_hook(HOOK_MONITOR_CONNECT, OBJECT_MONITOR, monitor); }
+void scripting_on_monitor_disconnect(void *monitor) { queue_destroy_hook(HOOK_MONITOR_DISCONNECT, OBJECT_MONITOR, monitor); }
+
+/* dwl is shutting down, so run what is queued and the hook right away,
+ * unless Wren is running and neither can */
+void scripting_on_quit(void) {
+	if (!vm || wren_depth)
+		return;
+	if (!draining)
+		drain_events();
+	call_hook(HOOK_QUIT);
+}
+
+/* Called with the new and previously focused client */
+void scripting_on_client_focus(void *client, void *old) {
+	if (!vm || !hook_handles[HOOK_CLIENT_FOCUS])
+		return;
+
+	ScriptRef a = object_ref(OBJECT_CLIENT, client);
+	ScriptRef b = object_ref(OBJECT_CLIENT, old);
+
+	/* Replace a pending change, keeping the client focused before it */
+	int pos = find_queued(HOOK_CLIENT_FOCUS, NULL);
+	if (pos >= 0) {
+		ScriptRef first = queued_at(pos)->args[1];
+		if (!first.id || ref_alive(&first))
+			b = first;
+		unqueue(pos);
+	}
+	queue_hook(HOOK_CLIENT_FOCUS, 2, a, b);
+}
+
+void scripting_on_tag_change(unsigned int tags) {
+	if (!vm || !hook_handles[HOOK_TAG_CHANGE])
+		return;
+
+	int pos = find_queued(HOOK_TAG_CHANGE, NULL);
+	if (pos >= 0)
+		unqueue(pos);
+
+	ScriptEvent *ev = queue_event(HOOK_TAG_CHANGE);
+	if (!ev)
+		return;
+	ev->tags = tags;
+	schedule_drain();
+}
+
+void scripting_on_layout_change(void *monitor) {
+	if (!vm || !hook_handles[HOOK_LAYOUT_CHANGE])
+		return;
+
+	ScriptRef m = object_ref(OBJECT_MONITOR, monitor);
+	int pos = find_queued(HOOK_LAYOUT_CHANGE, &m);
+	if (pos >= 0)
+		unqueue(pos);
+	queue_hook(HOOK_LAYOUT_CHANGE, 1, m, no_object);
+}
 
 bool scripting_eval(const char *source) {
-	if (!vm) return false;
-	return wrenInterpret(vm, "main", source) == WREN_RESULT_SUCCESS;
+	if (!vm || wren_depth) return false;
+	wren_depth++;
+	bool ok = wrenInterpret(vm, "main", source) == WREN_RESULT_SUCCESS;
+	wren_leave();
+	return ok;
 }
 
 bool scripting_run_file(const char *path) {
@@ -6,21 +6,29 @@
 
 #include <stdbool.h>
 
+struct wl_event_loop;
+
 /* Initialize the Wren VM and load init script */
 bool scripting_init(void);
 
 /* Clean up the Wren VM */
 void scripting_cleanup(void);
 
-/* Call a hook by name with optional arguments */
+/* Set the event loop hooks are run from once it is idle. Without one,
+ * hooks run as soon as they are triggered. */
+void scripting_set_event_loop(struct wl_event_loop *loop);
+
+/* Queue a hook by name, called without arguments */
 void scripting_hook(const char *hook_name);
 
-/* Hooks called from dwl */
+/* Hooks called from dwl. Scripts get the client or monitor as a foreign
+ * object, the tag mask for tagChange, and the new and previously focused
+ * client for clientFocus. All but quit are queued and run at idle. */
 void scripting_on_startup(void);
 void scripting_on_quit(void);
 void scripting_on_client_create(void *client);
 void scripting_on_client_destroy(void *client);
-void scripting_on_client_focus(void *client);
+void scripting_on_client_focus(void *client, void *old);
 void scripting_on_tag_change(unsigned int tags);
 void scripting_on_layout_change(void *monitor);
 void scripting_on_monitor_connect(void *monitor);
@@ -43,12 +51,13 @@ bool scripting_handle_key(unsigned int mod, unsigned int key);
 /* No-op stubs when scripting is disabled */
 #define scripting_init() (true)
 #define scripting_cleanup() ((void)0)
+#define scripting_set_event_loop(l) ((void)0)
 #define scripting_hook(name) ((void)0)
 #define scripting_on_startup() ((void)0)
 #define scripting_on_quit() ((void)0)
 #define scripting_on_client_create(c) ((void)0)
 #define scripting_on_client_destroy(c) ((void)0)
-#define scripting_on_client_focus(c) ((void)0)
+#define scripting_on_client_focus(c, o) ((void)0)
 #define scripting_on_tag_change(t) ((void)0)
 #define scripting_on_layout_change(m) ((void)0)
 #define scripting_on_monitor_connect(m) ((void)0)
@@ -1,4 +1,5 @@
 #include "icon.h"
+#include "../pixel.h"
 
 #include <fcft/fcft.h>
 #include <pixman.h>
@@ -8,8 +9,6 @@
 #include <stdlib.h>
 #include <string.h>
 
-#define PREMUL_ALPHA(chan, alpha) (chan * alpha + 127) / 255
-
 /*
  * Converts pixels from uint8_t[4] to uint32_t and
  * straight alpha to premultiplied alpha.
@@ -24,30 +23,8 @@ to_pixman(const uint8_t *src, int n_pixels, size_t *pix_size)
 	if (!dest)
 		return NULL;
 
-	for (int i = 0; i < n_pixels; i++) {
-		uint8_t a = src[i * 4 + 0];
-		uint8_t r = src[i * 4 + 1];
-		uint8_t g = src[i * 4 + 2];
-		uint8_t b = src[i * 4 + 3];
-
-		/*
-		 * Skip premultiplying fully opaque and fully transparent
-		 * pixels.
-		 */
-		if (a == 0) {
-			dest[i] = 0;
-
-		} else if (a == 255) {
-			dest[i] = ((uint32_t)a << 24) | ((uint32_t)r << 16) |
-			          ((uint32_t)g << 8) | ((uint32_t)b);
-
-		} else {
-			dest[i] = ((uint32_t)a << 24) |
-			          ((uint32_t)PREMUL_ALPHA(r, a) << 16) |
-			          ((uint32_t)PREMUL_ALPHA(g, a) << 8) |
-			          ((uint32_t)PREMUL_ALPHA(b, a));
-		}
-	}
+	/* Rounds like (chan * alpha + 127) / 255 */
+	pixel_premultiply_argb(dest, src, n_pixels);
 
 	return dest;
 }
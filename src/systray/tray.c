@@ -54,6 +54,12 @@ tray_update(Tray *tray)
 	int icon_size, i = 0, canvas_width, canvas_height, n_items, spacing;
 	pixman_image_t *canvas = NULL, *img;
 
+	/* Nobody would see it, compose once unpaused */
+	if (tray->paused) {
+		tray->dirty = 1;
+		return;
+	}
+
 	watcher = tray_get_watcher(tray);
 	n_items = watcher_get_n_items(watcher);
 
@@ -138,6 +144,23 @@ fail:
 	return;
 }
 
+/* Returns 1 if changes held back while paused were composed, which also
+ * notifies the monitor */
+int
+tray_set_paused(Tray *tray, int paused)
+{
+	if (!tray)
+		return 0;
+
+	tray->paused = paused;
+	if (paused || !tray->dirty)
+		return 0;
+
+	tray->dirty = 0;
+	tray_update(tray);
+	return 1;
+}
+
 void
 destroytray(Tray *tray)
 {
@@ -19,6 +19,8 @@ typedef struct {
 	void *monitor;
 	int height;
 	int spacing;
+	int paused; /* icons changed while paused are composed on resume */
+	int dirty;
 
 	struct wl_list link;
 } Tray;
@@ -31,6 +33,7 @@ void destroytray (Tray *tray);
 int tray_get_width (const Tray *tray);
 int tray_get_icon_width (const Tray *tray);
 void tray_update (Tray *tray);
+int tray_set_paused (Tray *tray, int paused);
 void tray_leftclicked (Tray *tray, unsigned int index);
 void tray_rightclicked (Tray *tray, unsigned int index, const char **menucmd);
 
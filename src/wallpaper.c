@@ -1,21 +1,35 @@
 /* wallpaper.c - wallpaper slideshow support for dwl */
+#define _DEFAULT_SOURCE /* d_type */
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 #include <wordexp.h>
 #include <wayland-server-core.h>
 #include <wlr/render/wlr_renderer.h>
+#include <wlr/types/wlr_output.h>
 #include <wlr/types/wlr_scene.h>
 #include <wlr/interfaces/wlr_buffer.h>
 #include <drm_fourcc.h>
+#include <pixman.h>
 
+#include "activity.h"
+#include "pixel.h"
+#include "resample.h"
 #include "wallpaper.h"
 
 #include <math.h>
@@ -23,10 +37,18 @@
 #define M_PI 3.14159265358979323846
 #endif
 
+#ifdef JPEG_SCALE
+#include <turbojpeg.h>
+#endif
+
 #ifdef EXTRAS
+#include <wlr/render/allocator.h>
+#include <wlr/render/drm_format_set.h>
 #include <wlr/render/egl.h>
 #include <wlr/render/gles2.h>
+#include <wlr/render/swapchain.h>
 #include <GLES2/gl2.h>
+#include <GLES2/gl2ext.h>
 #include <EGL/egl.h>
 #endif
 
@@ -40,6 +62,22 @@
 #define GRADIENT_ANGLE 33.0 /* degrees */
 
 #define MAX_PATH 4096
+#define LENGTH(X) (sizeof X / sizeof X[0])
+#define SHADER_FRAME_MS 33 /* shortest time between shader frames */
+#define SHADER_FRAME_MS_MAX 250  /* longest, when over budget at lowest scale */
+#define SHADER_SCALE_MIN 0.25f   /* lowest shader render scale */
+#define SHADER_SAMPLE_FRAMES 8   /* frames between shader cost measurements */
+#define HISTORY_SIZE 64
+#define TRANSITION_FRAME_MS 16 /* time between transition steps */
+#define ANIM_MIN_DELAY_MS 20     /* shorter GIF delays are shown at ANIM_DEFAULT_DELAY_MS */
+#define ANIM_DEFAULT_DELAY_MS 100
+#define DISK_CACHE_MAGIC "DWLWP\0\0\2"
+#define DISK_CACHE_SCAN_S (60 * 60) /* time between scans for old cache files */
+#define DISK_CACHE_TMP_AGE (10 * 60) /* our own unfinished writes kept this long */
+#define PROGRAM_CACHE_MAGIC "DWLSH\0\0\1"
+#define PROGRAM_CACHE_SIZE 32 /* linked shader programs kept */
+#define PROGRAM_CACHE_DISK_LIMIT ((size_t)32 << 20) /* saved program binaries kept */
+#define SHADER_WARMUP_MS 100  /* pause between ahead-of-time compiles */
 
 /* Scaling modes */
 enum {
@@ -49,27 +87,258 @@ enum {
 	SCALE_COVER,   /* Cover screen (may crop) */
 };
 
+/* Items drawn in random order without repeats.
+ * items[0, left) have not been drawn in the current round. */
+typedef struct {
+	void **items;
+	int count;
+	int left;
+	int capacity;
+	void *last; /* most recent draw */
+} ShuffleBag;
+
+/* Indexed wallpaper directory, kept current through inotify */
+typedef struct {
+	struct wl_list link;
+	char *path;
+	int wd;         /* inotify watch, -1 if none */
+	int scanned;    /* images, shaders and scale_mode are valid */
+	int pickable;   /* direct subdirectory of base_path */
+	int scale_mode; /* from .scaling, -1 if none */
+	ShuffleBag images; /* file names */
+#ifdef EXTRAS
+	ShuffleBag shaders; /* file names */
+#endif
+} IndexDir;
+
 /* Wallpaper buffer for wlr_scene */
 typedef struct {
 	struct wlr_buffer base;
 	void *data;
 	uint32_t format;
 	size_t stride;
+	void *map; /* read-only disk cache mapping holding data, or NULL */
+	size_t map_size;
+	struct wl_listener release; /* shader ring: scene let go of it */
+	int busy;
+	struct wlr_fbox src; /* part the scene shows, empty for all of it */
+	struct wlr_box dst;  /* where on the output in its pixels, empty to fill it */
+	int out_width, out_height; /* output resolution it was made for */
+	struct wlr_box opaque; /* part without alpha, XRGB when that is all of it */
 } WallpaperBuffer;
 
-static struct {
+/* GIF decoded one frame at a time from a mapping of its file, so a large
+ * animation never exists decoded as a whole. Each frame is drawn over the
+ * one before, so going back means starting over. */
+typedef struct {
+	unsigned char *file;
+	size_t size;
+	int count;   /* frames, from gif_scan */
+	int *delays; /* ms each frame is shown */
+	stbi__context ctx;
+	stbi__gif gif;
+	unsigned char *prev, *two_back; /* last two frames, for disposal to previous */
+	int pos; /* frame gif_next decodes */
+} GifStream;
+
+/* Frames of an animated wallpaper, shared by the outputs showing it.
+ * A streamed one belongs to a single output and only keeps the frame it
+ * shows and the next; the worker decodes the rest as they are due. */
+typedef struct {
+	int refs;
+	int count;
+	int *delays;              /* ms each frame is shown */
+	WallpaperBuffer **frames; /* producer references, NULL if not decoded */
+	int scaled;               /* at output size, else source size placed by the scene */
+	int scale_mode;
+	GifStream *stream;  /* decodes frames on demand, NULL if all are kept */
+	int width, height;  /* size of streamed frames */
+	int decoding;       /* frame a job is decoding, -1 if none */
+	int waiting;        /* the due frame is still being decoded */
+} Animation;
+
+/* Disk cache file header, followed by height rows of stride bytes of BGRA */
+typedef struct {
+	char magic[8];
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	int32_t opaque[4]; /* JobTarget.opaque */
+	uint32_t reserved;
+} DiskCacheHeader;
+
+/* Scaled image kept for reuse, keyed by path, size, scale mode and filter */
+typedef struct {
+	struct wl_list link;
+	char *path;
+	int width;
+	int height;
+	int scale_mode;
+	int filter;
+	WallpaperBuffer *buffer; /* cache owns the producer reference */
+} CacheEntry;
+
+/* Visited image, remembered with the scaling mode it was shown in */
+typedef struct {
+	char *path;
+	int scale_mode;
+} HistoryEntry;
+
+/* Wallpaper of one output, rendered at its physical resolution */
+typedef struct {
+	struct wl_list link;
+	struct wlr_output *output;
 	struct wlr_scene_buffer *scene_buffer;
+	WallpaperBuffer *buffer; /* locked while shown */
+	WallpaperBuffer *staged; /* prefetched next wallpaper, locked */
+	unsigned int id;     /* lets finished jobs find their output */
+	unsigned int serial; /* latest image requested for this output */
+	int x, y;            /* layout position */
+	int width, height;   /* logical size */
+	int buf_width, buf_height; /* transformed physical resolution */
+	struct wlr_scene_buffer *old_scene; /* previous wallpaper during a transition */
+	WallpaperBuffer *old;               /* locked while it transitions out */
+	struct timespec transition_start;
+	int transition;   /* WallpaperTransition* running */
+	Animation *anim;  /* playing, frames shown one after another */
+	int anim_pos;
+	struct timespec anim_next; /* when the next frame is due */
+#ifdef EXTRAS
+	struct wlr_swapchain *swapchain; /* shader frames rendered on the GPU */
+	WallpaperBuffer *pool[2];        /* shader frames read back, reused */
+	struct wl_listener frame_done;   /* scene showed the wallpaper */
+	int shader_due;                  /* render its next shader frame */
+#endif
+} WallpaperOutput;
+
+#ifdef EXTRAS
+/* Linked shader program, keyed by a hash of its sources and the driver */
+typedef struct {
+	struct wl_list link;
+	uint64_t hash;
+	GLuint program;
+	GLint u_time;
+	GLint u_resolution;
+} ShaderProgram;
+
+/* EGL state saved while the renderer's context is borrowed */
+typedef struct {
+	EGLDisplay display;
+	EGLContext context;
+	EGLSurface draw, read;
+} GLSaved;
+
+/* Program binary file header, followed by length bytes of binary */
+typedef struct {
+	char magic[8];
+	uint32_t format;
+	uint32_t length;
+} ProgramCacheHeader;
+#endif
+
+/* One output a job scales for */
+typedef struct {
+	unsigned int output_id;
+	unsigned int serial;
+	int width;
+	int height;
+	unsigned char *data; /* BGRA result, NULL if decoding failed */
+	void *map;           /* disk cache mapping holding data, or NULL */
+	size_t map_size;
+	unsigned char **frames; /* animation scaled for this output, or NULL */
+	int source_frames;      /* plays the job's source-size frames instead */
+	GifStream *stream;      /* or decodes them as it plays, first one in data */
+	int data_width, data_height; /* size of data when the scene places it */
+	struct wlr_fbox src;         /* placement, see WallpaperBuffer */
+	struct wlr_box dst;
+	struct wlr_box opaque;       /* part of data without alpha */
+} JobTarget;
+
+/* Decode/scale request handed to the worker thread.
+ * The image is decoded once and scaled for every target. */
+typedef struct {
+	struct wl_list link;
+	char path[MAX_PATH];
+	int scale_mode;
+	int filter;
+	int prefetch; /* stage the result instead of showing it */
+	int scene_scale; /* leave scaling to the scene, see scene_image */
+	int nframes;  /* animation frames, 0 for still images */
+	int *delays;
+	unsigned char **frames; /* BGRA at source size, for targets over budget */
+	int frame_width, frame_height;
+	Animation *anim; /* streamed animation this job decodes a frame of */
+	int frame;
+	int ntargets;
+	JobTarget targets[];
+} WallpaperJob;
+
+static struct {
+	struct wlr_scene_tree *tree; /* parent of the per-output buffers */
 	struct wlr_scene *scene;
 	struct wlr_renderer *renderer;
-	WallpaperBuffer *buffer;
+	struct wl_list outputs; /* WallpaperOutput.link */
+	unsigned int next_output_id;
 
 	struct wl_event_source *timer;
 	struct wl_event_loop *event_loop;
+	int slideshow_due; /* change skipped while no output could be seen */
+	struct wl_listener activity;
+
+	/* Worker thread: decodes and scales off the event loop */
+	pthread_t worker;
+	pthread_mutex_t job_lock;
+	pthread_cond_t job_cond;
+	int worker_running;
+	int worker_quit;
+	int job_fd; /* eventfd signalled when a job finishes */
+	struct wl_event_source *job_source;
+	unsigned int job_serial; /* source of WallpaperOutput.serial */
+	struct wl_list pending; /* WallpaperJob.link, guarded by job_lock */
+	struct wl_list done;    /* WallpaperJob.link, guarded by job_lock */
+
+	/* Next image, picked early and decoded into WallpaperOutput.staged */
+	char next_file[MAX_PATH];
+	int next_scale_mode;
+	unsigned int prefetch_serial; /* current prefetch job */
+	WallpaperJob *prefetch_job;   /* queued or running, freed on the event loop */
+	struct wl_event_source *prefetch_idle;
+
+	/* Scaled images, most recently used first */
+	struct wl_list cache; /* CacheEntry.link */
+	size_t cache_size;
+	size_t cache_limit;
+
+	/* Visited images, oldest first from history_start */
+	HistoryEntry history[HISTORY_SIZE];
+	int history_start;
+	int history_len;
+	int history_pos; /* current entry, counted from the oldest */
 
-	int width;
-	int height;
 	int interval;
 	int scale_mode;
+	int filter;
+	int scene_scaling; /* fit, cover and center scaled by the scene */
+	int transition;    /* WallpaperTransition* */
+	int transition_ms;
+	struct wl_event_source *transition_timer;
+	struct wl_event_source *anim_timer;
+	size_t anim_limit; /* frames one animation may keep, read by the worker */
+
+	/* Scaled images on disk, only touched by the worker once it runs */
+	char disk_cache_dir[MAX_PATH]; /* empty if disabled */
+	size_t disk_cache_limit;
+	time_t disk_cache_max_age;
+	size_t disk_cache_size;    /* bytes in disk_cache_dir as of the last scan and stores */
+	time_t disk_cache_scanned; /* 0 until the first scan */
+
+	/* Library index, built lazily and updated from inotify */
+	struct wl_list dirs; /* IndexDir.link */
+	ShuffleBag subdirs;  /* pickable IndexDir */
+	int index_ready;     /* base_path has been scanned */
+	int inotify_fd;
+	int base_wd;
+	struct wl_event_source *inotify_source;
 
 	char base_path[MAX_PATH];
 	char current_dir[MAX_PATH];
@@ -83,25 +352,57 @@ static struct {
 	GLuint vbo;
 	GLuint fbo;
 	GLuint render_texture;
+	int render_width, render_height; /* render_texture storage size */
+	unsigned char *readback;         /* glReadPixels target */
+	size_t readback_size;
+	struct wlr_allocator *allocator;
+	struct wlr_drm_format shader_format;
+	int gpu_failed; /* fall back to reading frames back */
 	GLint u_time;
 	GLint u_resolution;
 	struct wl_event_source *shader_timer;
+	int shader_timer_armed;
 	float shader_time;
+	struct timespec shader_start;      /* time uniform counts from here */
+	struct timespec shader_last_frame;
+	float shader_scale;     /* render size relative to the output */
+	float shader_scale_max;
+	int shader_budget_ms;   /* governor target per frame, 0 if off */
+	int shader_frame_ms;    /* time between frames */
+	int shader_frames;      /* frames since the last measurement */
+	float shader_cost;      /* smoothed ms per measured frame */
+
+	/* Program cache, most recently used first */
+	struct wl_list programs;
+	int nprograms;
+	char program_cache_dir[MAX_PATH]; /* empty if binaries are not kept */
+	int program_binary_checked;
+	PFNGLGETPROGRAMBINARYOESPROC get_program_binary;
+	PFNGLPROGRAMBINARYOESPROC program_binary;
+	struct wl_event_source *warmup_timer;
+	char **warmup;    /* shader paths still to compile */
+	int warmup_count;
+	int warmup_pos;
 #endif
 } wp;
 
 /* Forward declarations */
 static void load_random_image(void);
 static void load_gradient_fallback(void);
+static void load_gradient_output(WallpaperOutput *o);
+static void schedule_prefetch(void);
+static void animation_unref(Animation *anim);
+static void queue_job(WallpaperJob *job);
 static void read_scale_mode(const char *dir_path);
 static char *expand_path(const char *path);
-static char *pick_random_subdir(const char *path);
+static char *pick_random_subdir(void);
 static char *pick_random_image(const char *dir_path);
 #ifdef EXTRAS
 static int is_shader_file(const char *name);
 static char *pick_random_shader(const char *dir_path);
 static int load_shader_file(const char *path);
 static void render_shader_frame(void);
+static void render_shader_output(WallpaperOutput *o);
 static void cleanup_shader(void);
 static int shader_frame_callback(void *data);
 #endif
@@ -109,7 +410,11 @@ static int shader_frame_callback(void *data);
 /* Buffer implementation */
 static void buffer_destroy(struct wlr_buffer *wlr_buffer) {
 	WallpaperBuffer *buffer = wl_container_of(wlr_buffer, buffer, base);
-	if (buffer->data)
+	if (buffer->busy)
+		wl_list_remove(&buffer->release.link);
+	if (buffer->map)
+		munmap(buffer->map, buffer->map_size);
+	else if (buffer->data)
 		free(buffer->data);
 	free(buffer);
 }
@@ -117,6 +422,8 @@ static void buffer_destroy(struct wlr_buffer *wlr_buffer) {
 static bool buffer_begin_data_ptr_access(struct wlr_buffer *wlr_buffer,
 		uint32_t flags, void **data, uint32_t *format, size_t *stride) {
 	WallpaperBuffer *buffer = wl_container_of(wlr_buffer, buffer, base);
+	if (buffer->map && (flags & WLR_BUFFER_DATA_PTR_ACCESS_WRITE))
+		return false;
 	*data = buffer->data;
 	*format = buffer->format;
 	*stride = buffer->stride;
@@ -147,12 +454,8 @@ static char *expand_path(const char *path) {
 }
 
 static int is_directory(const char *path) {
-	DIR *dir = opendir(path);
-	if (dir) {
-		closedir(dir);
-		return 1;
-	}
-	return 0;
+	struct stat st;
+	return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
 }
 
 static int is_image_file(const char *name) {
@@ -178,144 +481,399 @@ static int is_shader_file(const char *name) {
 }
 #endif
 
-/* Pick a random subdirectory from path, returns allocated string or NULL */
-static char *pick_random_subdir(const char *path) {
+/* Add item to the bag; it takes part in the current round */
+static int bag_add(ShuffleBag *bag, void *item) {
+	void **items;
+	int capacity;
+
+	if (bag->count >= bag->capacity) {
+		capacity = bag->capacity ? bag->capacity * 2 : 16;
+		items = realloc(bag->items, capacity * sizeof(*items));
+		if (!items)
+			return 0;
+		bag->items = items;
+		bag->capacity = capacity;
+	}
+	bag->items[bag->count] = bag->items[bag->left];
+	bag->items[bag->left++] = item;
+	bag->count++;
+	return 1;
+}
+
+/* Remove and return the item at index i */
+static void *bag_remove(ShuffleBag *bag, int i) {
+	void *item = bag->items[i];
+
+	if (i < bag->left) {
+		bag->items[i] = bag->items[--bag->left];
+		i = bag->left;
+	}
+	bag->items[i] = bag->items[--bag->count];
+	if (bag->last == item)
+		bag->last = NULL;
+	return item;
+}
+
+static int bag_find_name(const ShuffleBag *bag, const char *name) {
+	for (int i = 0; i < bag->count; i++) {
+		if (strcmp(bag->items[i], name) == 0)
+			return i;
+	}
+	return -1;
+}
+
+/* Draw a random item, avoiding skip unless nothing else is left.
+ * A new round starts once every item has been drawn. */
+static void *bag_draw(ShuffleBag *bag, const void *skip) {
+	void *item;
+	int i;
+
+	if (bag->count == 0)
+		return NULL;
+	if (bag->left == 0 || (bag->left == 1 && bag->items[0] == skip))
+		bag->left = bag->count;
+
+	i = rand() % bag->left;
+	if (bag->items[i] == skip && bag->left > 1)
+		i = (i + 1 + rand() % (bag->left - 1)) % bag->left;
+
+	item = bag->items[i];
+	bag->items[i] = bag->items[--bag->left];
+	bag->items[bag->left] = item;
+	bag->last = item;
+	return item;
+}
+
+static void bag_clear(ShuffleBag *bag, int free_items) {
+	if (free_items) {
+		for (int i = 0; i < bag->count; i++)
+			free(bag->items[i]);
+	}
+	free(bag->items);
+	memset(bag, 0, sizeof(*bag));
+}
+
+/* Parse a directory's .scaling file, returns -1 if absent or unknown */
+static int read_scaling_file(const char *dir_path) {
+	char path[MAX_PATH];
+	FILE *f;
+	char buf[32];
+	size_t len;
+	int mode = -1;
+
+	snprintf(path, sizeof(path), "%s/.scaling", dir_path);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+
+	if (fgets(buf, sizeof(buf), f)) {
+		len = strlen(buf);
+		if (len > 0 && buf[len - 1] == '\n')
+			buf[len - 1] = '\0';
+
+		if (strcasecmp(buf, "tile") == 0)
+			mode = SCALE_TILE;
+		else if (strcasecmp(buf, "center") == 0)
+			mode = SCALE_CENTER;
+		else if (strcasecmp(buf, "fit") == 0)
+			mode = SCALE_FIT;
+		else if (strcasecmp(buf, "cover") == 0)
+			mode = SCALE_COVER;
+	}
+
+	fclose(f);
+	return mode;
+}
+
+static void index_unwatch(int wd) {
+	if (wd >= 0 && wp.inotify_fd >= 0)
+		inotify_rm_watch(wp.inotify_fd, wd);
+}
+
+/* Forget a directory's files so the next pick rescans it */
+static void index_reset_dir(IndexDir *d) {
+	index_unwatch(d->wd);
+	d->wd = -1;
+	d->scanned = 0;
+	bag_clear(&d->images, 1);
+#ifdef EXTRAS
+	bag_clear(&d->shaders, 1);
+#endif
+}
+
+static void index_add_file(IndexDir *d, const char *name) {
+	ShuffleBag *bag;
+	char *copy;
+
+	if (is_image_file(name))
+		bag = &d->images;
+#ifdef EXTRAS
+	else if (is_shader_file(name))
+		bag = &d->shaders;
+#endif
+	else
+		return;
+
+	if (bag_find_name(bag, name) >= 0)
+		return;
+	copy = strdup(name);
+	if (copy && !bag_add(bag, copy))
+		free(copy);
+}
+
+static void index_remove_file(IndexDir *d, const char *name) {
+	int i;
+
+	if ((i = bag_find_name(&d->images, name)) >= 0)
+		free(bag_remove(&d->images, i));
+#ifdef EXTRAS
+	if ((i = bag_find_name(&d->shaders, name)) >= 0)
+		free(bag_remove(&d->shaders, i));
+#endif
+}
+
+/* Read a directory's file names and .scaling once, then follow inotify */
+static void index_scan_dir(IndexDir *d) {
 	DIR *dir;
 	struct dirent *entry;
-	char **dirs = NULL;
-	int count = 0;
-	int capacity = 0;
-	char *result = NULL;
-	char full_path[MAX_PATH];
 
-	dir = opendir(path);
+	/* Without inotify the index can go stale, so rescan every time */
+	if (d->scanned && wp.inotify_fd >= 0)
+		return;
+	index_reset_dir(d);
+
+	dir = opendir(d->path);
 	if (!dir)
-		return NULL;
+		return;
+
+	if (wp.inotify_fd >= 0)
+		d->wd = inotify_add_watch(wp.inotify_fd, d->path,
+				IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE
+				| IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
 
 	while ((entry = readdir(dir)) != NULL) {
-		if (entry->d_name[0] == '.')
+		if (entry->d_name[0] == '.' || entry->d_type == DT_DIR)
 			continue;
+		index_add_file(d, entry->d_name);
+	}
+	closedir(dir);
 
-		snprintf(full_path, sizeof(full_path), "%s/%s", path, entry->d_name);
+	d->scale_mode = read_scaling_file(d->path);
+	d->scanned = 1;
+}
 
-		if (is_directory(full_path)) {
-			/* Skip current directory unless it's the only one */
-			if (strcmp(full_path, wp.current_dir) == 0)
-				continue;
+static IndexDir *index_find_dir(const char *path) {
+	IndexDir *d;
 
-			if (count >= capacity) {
-				capacity = capacity ? capacity * 2 : 16;
-				dirs = realloc(dirs, capacity * sizeof(char *));
-			}
-			dirs[count++] = strdup(full_path);
-		}
+	wl_list_for_each(d, &wp.dirs, link) {
+		if (strcmp(d->path, path) == 0)
+			return d;
 	}
-	closedir(dir);
+	return NULL;
+}
 
-	/* If no other dirs found, fall back to current */
-	if (count == 0 && wp.current_dir[0] != '\0') {
-		return strdup(wp.current_dir);
-	}
+static IndexDir *index_add_dir(const char *path, int pickable) {
+	IndexDir *d = calloc(1, sizeof(*d));
 
-	if (count > 0) {
-		int idx = rand() % count;
-		result = dirs[idx];
-		dirs[idx] = NULL; /* Don't free the one we're returning */
+	if (!d)
+		return NULL;
+	d->path = strdup(path);
+	d->wd = -1;
+	d->scale_mode = -1;
+	d->pickable = pickable;
+	if (!d->path || (pickable && !bag_add(&wp.subdirs, d))) {
+		free(d->path);
+		free(d);
+		return NULL;
 	}
+	wl_list_insert(wp.dirs.prev, &d->link);
+	return d;
+}
+
+static void index_remove_dir(IndexDir *d) {
+	int i;
 
-	/* Free the rest */
-	for (int i = 0; i < count; i++) {
-		if (dirs[i])
-			free(dirs[i]);
+	if (d->pickable) {
+		for (i = 0; i < wp.subdirs.count; i++) {
+			if (wp.subdirs.items[i] == d) {
+				bag_remove(&wp.subdirs, i);
+				break;
+			}
+		}
 	}
-	free(dirs);
+	index_reset_dir(d);
+	wl_list_remove(&d->link);
+	free(d->path);
+	free(d);
+}
 
-	return result;
+/* Drop the whole index; it is rebuilt on the next pick */
+static void index_clear(void) {
+	while (!wl_list_empty(&wp.dirs)) {
+		IndexDir *d = wl_container_of(wp.dirs.next, d, link);
+		index_remove_dir(d);
+	}
+	bag_clear(&wp.subdirs, 0);
+	index_unwatch(wp.base_wd);
+	wp.base_wd = -1;
+	wp.index_ready = 0;
 }
 
-/* Pick a random image from dir_path, returns allocated string or NULL */
-static char *pick_random_image(const char *dir_path) {
+/* List the subdirectories of base_path */
+static void index_scan_base(void) {
 	DIR *dir;
 	struct dirent *entry;
-	char **images = NULL;
-	int count = 0;
-	int capacity = 0;
-	char *result = NULL;
 	char full_path[MAX_PATH];
+	int is_dir;
 
-	dir = opendir(dir_path);
+	if (wp.index_ready && wp.inotify_fd >= 0)
+		return;
+	index_clear();
+
+	dir = opendir(wp.base_path);
 	if (!dir)
-		return NULL;
+		return;
+
+	if (wp.inotify_fd >= 0)
+		wp.base_wd = inotify_add_watch(wp.inotify_fd, wp.base_path,
+				IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ONLYDIR);
 
 	while ((entry = readdir(dir)) != NULL) {
 		if (entry->d_name[0] == '.')
 			continue;
 
-		if (is_image_file(entry->d_name)) {
-			snprintf(full_path, sizeof(full_path), "%s/%s", dir_path, entry->d_name);
+		snprintf(full_path, sizeof(full_path), "%s/%s", wp.base_path, entry->d_name);
 
-			/* Skip current image unless it's the only one */
-			if (strcmp(full_path, wp.current_file) == 0)
-				continue;
+		/* Only stat entries the filesystem could not type for us */
+		if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK)
+			is_dir = is_directory(full_path);
+		else
+			is_dir = entry->d_type == DT_DIR;
 
-			if (count >= capacity) {
-				capacity = capacity ? capacity * 2 : 16;
-				images = realloc(images, capacity * sizeof(char *));
-			}
-			images[count++] = strdup(full_path);
-		}
+		if (is_dir)
+			index_add_dir(full_path, 1);
 	}
 	closedir(dir);
 
-	/* If no other images found, fall back to current only if it's in this directory */
-	if (count == 0 && wp.current_file[0] != '\0') {
-		if (strncmp(wp.current_file, dir_path, strlen(dir_path)) == 0) {
-			return strdup(wp.current_file);
-		}
+	wp.index_ready = 1;
+}
+
+/* Look up a directory, indexing it if it lies outside base_path's subdirectories */
+static IndexDir *index_get_dir(const char *path) {
+	IndexDir *d;
+
+	index_scan_base();
+	d = index_find_dir(path);
+	if (!d && is_directory(path))
+		d = index_add_dir(path, 0);
+	if (d)
+		index_scan_dir(d);
+	return d;
+}
+
+static void index_handle_event(const struct inotify_event *ev) {
+	char full_path[MAX_PATH];
+	IndexDir *d;
+	int added = ev->mask & (IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE);
+	int removed = ev->mask & (IN_DELETE | IN_MOVED_FROM);
+
+	if (ev->mask & IN_Q_OVERFLOW) {
+		index_clear();
+		return;
 	}
 
-	if (count > 0) {
-		int idx = rand() % count;
-		result = images[idx];
-		images[idx] = NULL;
+	if (ev->wd == wp.base_wd) {
+		if (ev->mask & IN_IGNORED) {
+			wp.base_wd = -1;
+			wp.index_ready = 0;
+			return;
+		}
+		if (!ev->len || ev->name[0] == '.')
+			return;
+		snprintf(full_path, sizeof(full_path), "%s/%s", wp.base_path, ev->name);
+		d = index_find_dir(full_path);
+		if (removed && d)
+			index_remove_dir(d);
+		else if (added && !d && is_directory(full_path))
+			index_add_dir(full_path, 1);
+		return;
 	}
 
-	for (int i = 0; i < count; i++) {
-		if (images[i])
-			free(images[i]);
+	wl_list_for_each(d, &wp.dirs, link) {
+		if (d->wd == ev->wd)
+			break;
 	}
-	free(images);
+	if (&d->link == &wp.dirs)
+		return;
 
-	return result;
-}
+	if (ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+		if (ev->mask & IN_IGNORED)
+			d->wd = -1;
+		index_reset_dir(d);
+		return;
+	}
 
-static void read_scale_mode(const char *dir_path) {
-	char path[MAX_PATH];
-	FILE *f;
-	char buf[32];
-	size_t len;
+	if (!ev->len || (ev->mask & IN_ISDIR))
+		return;
 
-	snprintf(path, sizeof(path), "%s/.scaling", dir_path);
-	f = fopen(path, "r");
-	if (!f)
+	if (strcmp(ev->name, ".scaling") == 0)
+		d->scale_mode = removed ? -1 : read_scaling_file(d->path);
+	else if (ev->name[0] == '.')
 		return;
+	else if (removed)
+		index_remove_file(d, ev->name);
+	else if (added)
+		index_add_file(d, ev->name);
+}
 
-	if (fgets(buf, sizeof(buf), f)) {
-		len = strlen(buf);
-		if (len > 0 && buf[len - 1] == '\n')
-			buf[len - 1] = '\0';
+static int index_inotify_callback(int fd, uint32_t mask, void *data) {
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	ssize_t len;
+	char *p;
 
-		if (strcasecmp(buf, "tile") == 0)
-			wp.scale_mode = SCALE_TILE;
-		else if (strcasecmp(buf, "center") == 0)
-			wp.scale_mode = SCALE_CENTER;
-		else if (strcasecmp(buf, "fit") == 0)
-			wp.scale_mode = SCALE_FIT;
-		else if (strcasecmp(buf, "cover") == 0)
-			wp.scale_mode = SCALE_COVER;
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			index_handle_event(ev);
+		}
 	}
 
-	fclose(f);
+	return 0;
+}
+
+/* Pick a random subdirectory of base_path, returns allocated string or NULL */
+static char *pick_random_subdir(void) {
+	IndexDir *d;
+
+	index_scan_base();
+	d = bag_draw(&wp.subdirs, index_find_dir(wp.current_dir));
+	return d ? strdup(d->path) : NULL;
+}
+
+/* Pick a name from bag in dir_path, returns allocated full path or NULL */
+static char *pick_from_bag(const char *dir_path, ShuffleBag *bag) {
+	char full_path[MAX_PATH];
+	const char *name = bag_draw(bag, bag->last);
+
+	if (!name)
+		return NULL;
+	snprintf(full_path, sizeof(full_path), "%s/%s", dir_path, name);
+	return strdup(full_path);
+}
+
+/* Pick a random image from dir_path, returns allocated string or NULL */
+static char *pick_random_image(const char *dir_path) {
+	IndexDir *d = index_get_dir(dir_path);
+
+	return d ? pick_from_bag(d->path, &d->images) : NULL;
+}
+
+static void read_scale_mode(const char *dir_path) {
+	IndexDir *d = index_get_dir(dir_path);
+
+	if (d && d->scale_mode >= 0)
+		wp.scale_mode = d->scale_mode;
 }
 
 /* Read .default file to get startup directory, returns allocated string or NULL */
@@ -355,178 +913,2033 @@ static char *read_default_dir(const char *base_path) {
 	return strdup(full_path);
 }
 
-static void load_image_file(const char *path) {
-	int img_w, img_h, channels;
-	unsigned char *img_data, *final_data;
-	size_t stride;
-	int x, y;
-	WallpaperBuffer *buffer;
-
-	if (wp.width == 0 || wp.height == 0)
-		return;
+/* Where an image lands on an output for a scale mode other than tile */
+typedef struct {
+	float scale;
+	int scaled_w, scaled_h;
+	int offset_x, offset_y; /* of the scaled image, negative when cropped */
+	struct wlr_box dst;     /* part on screen, in output pixels */
+	struct wlr_fbox src;    /* the same part in image pixels */
+} Layout;
+
+static void layout_image(Layout *l, int width, int height,
+		int img_w, int img_h, int scale_mode) {
+	float scale_x = (float)width / (float)img_w;
+	float scale_y = (float)height / (float)img_h;
+	int x1, y1;
+
+	if (scale_mode == SCALE_CENTER)
+		l->scale = 1.0f; /* No scaling */
+	else if (scale_mode == SCALE_FIT)
+		l->scale = scale_x < scale_y ? scale_x : scale_y;
+	else /* SCALE_COVER */
+		l->scale = scale_x > scale_y ? scale_x : scale_y;
+
+	l->scaled_w = (int)((float)img_w * l->scale);
+	l->scaled_h = (int)((float)img_h * l->scale);
+	if (l->scaled_w < 1)
+		l->scaled_w = 1;
+	if (l->scaled_h < 1)
+		l->scaled_h = 1;
+	l->offset_x = (width - l->scaled_w) / 2;
+	l->offset_y = (height - l->scaled_h) / 2;
+
+	l->dst.x = l->offset_x > 0 ? l->offset_x : 0;
+	l->dst.y = l->offset_y > 0 ? l->offset_y : 0;
+	x1 = l->offset_x + l->scaled_w < width ? l->offset_x + l->scaled_w : width;
+	y1 = l->offset_y + l->scaled_h < height ? l->offset_y + l->scaled_h : height;
+	l->dst.width = x1 - l->dst.x;
+	l->dst.height = y1 - l->dst.y;
+
+	/* Kept inside the image so rounding never samples past its edge */
+	l->src.x = (double)(l->dst.x - l->offset_x) / l->scale;
+	l->src.y = (double)(l->dst.y - l->offset_y) / l->scale;
+	l->src.width = fmin((double)l->dst.width / l->scale, img_w - l->src.x);
+	l->src.height = fmin((double)l->dst.height / l->scale, img_h - l->src.y);
+}
 
-	img_data = stbi_load(path, &img_w, &img_h, &channels, 4);
-	if (!img_data) {
-		fprintf(stderr, "wallpaper: failed to load %s\n", path);
-		return;
-	}
+/* Scale a decoded RGBA image to width x height BGRA pixels.
+ * Touches no shared state so it can run on the worker thread. */
+static unsigned char *scale_image(const unsigned char *img_data, int img_w, int img_h,
+		int width, int height, int scale_mode, int filter) {
+	unsigned char *final_data, *row;
+	size_t stride;
+	int x, y, n;
 
-	stride = wp.width * 4;
-	final_data = calloc(1, stride * wp.height);
-	if (!final_data) {
-		stbi_image_free(img_data);
-		return;
-	}
+	stride = width * 4;
+	final_data = calloc(1, stride * height);
+	if (!final_data)
+		return NULL;
 
-	if (wp.scale_mode == SCALE_TILE) {
-		/* Tile: repeat image across screen */
-		for (y = 0; y < wp.height; y++) {
-			for (x = 0; x < wp.width; x++) {
-				int src_x = x % img_w;
-				int src_y = y % img_h;
-				unsigned char *src = img_data + (src_y * img_w + src_x) * 4;
-				unsigned char *dst = final_data + (y * wp.width + x) * 4;
-				dst[0] = src[2]; /* B */
-				dst[1] = src[1]; /* G */
-				dst[2] = src[0]; /* R */
-				dst[3] = src[3]; /* A */
+	if (scale_mode == SCALE_TILE) {
+		/* Tile: convert the first copy of each source row, then repeat it
+		 * across the row and repeat whole rows below the first tile */
+		n = img_w < width ? img_w : width;
+		for (y = 0; y < height; y++) {
+			row = final_data + y * stride;
+			if (y >= img_h) {
+				memcpy(row, row - img_h * stride, stride);
+				continue;
 			}
+			pixel_swizzle(row, img_data + (size_t)y * img_w * 4, (size_t)n);
+			for (x = n; x < width; x += n)
+				memcpy(row + x * 4, row, (size_t)(x + n <= width ? n : width - x) * 4);
 		}
 	} else {
-		/* For center, fit, cover - calculate scaling */
-		float scale_x = (float)wp.width / img_w;
-		float scale_y = (float)wp.height / img_h;
-		float scale;
-		int scaled_w, scaled_h, offset_x, offset_y;
-
-		if (wp.scale_mode == SCALE_CENTER) {
-			scale = 1.0f; /* No scaling */
-		} else if (wp.scale_mode == SCALE_FIT) {
-			scale = (scale_x < scale_y) ? scale_x : scale_y;
-		} else { /* SCALE_COVER */
-			scale = (scale_x > scale_y) ? scale_x : scale_y;
-		}
-
-		scaled_w = (int)(img_w * scale);
-		scaled_h = (int)(img_h * scale);
-		offset_x = (wp.width - scaled_w) / 2;
-		offset_y = (wp.height - scaled_h) / 2;
-
-		for (y = 0; y < wp.height; y++) {
-			for (x = 0; x < wp.width; x++) {
-				int src_x = (x - offset_x) * img_w / scaled_w;
-				int src_y = (y - offset_y) * img_h / scaled_h;
-
-				if (src_x >= 0 && src_x < img_w && src_y >= 0 && src_y < img_h) {
-					unsigned char *src = img_data + (src_y * img_w + src_x) * 4;
-					unsigned char *dst = final_data + (y * wp.width + x) * 4;
-					dst[0] = src[2]; /* B */
-					dst[1] = src[1]; /* G */
-					dst[2] = src[0]; /* R */
-					dst[3] = src[3]; /* A */
-				}
-			}
+		Layout l;
+
+		/* Only resample the part of the scaled image that is on screen;
+		 * the rest stays black */
+		layout_image(&l, width, height, img_w, img_h, scale_mode);
+		if (!resample_rgba_to_bgra(img_data, img_w, img_h,
+				l.scaled_w, l.scaled_h, l.dst.x - l.offset_x, l.dst.y - l.offset_y,
+				final_data + l.dst.y * stride + l.dst.x * 4, l.dst.width, l.dst.height,
+				stride, filter)) {
+			free(final_data);
+			return NULL;
 		}
 	}
 
-	stbi_image_free(img_data);
+	return final_data;
+}
 
-	buffer = calloc(1, sizeof(WallpaperBuffer));
-	if (!buffer) {
-		free(final_data);
-		return;
+/* Like scale_image, but only for the part of the image on screen and at
+ * the lower of its own and its on-screen resolution, with t's placement
+ * set for the scene to scale it up. The border is left to root_bg. */
+static unsigned char *scene_image(const unsigned char *img_data, int img_w, int img_h,
+		JobTarget *t, int scale_mode, int filter) {
+	unsigned char *data;
+	Layout l;
+	int x0, y0, x1, y1, w, h, y;
+
+	layout_image(&l, t->width, t->height, img_w, img_h, scale_mode);
+	t->dst = l.dst;
+	if (l.scale < 1.0f) {
+		/* Shrunk: exactly the pixels on screen */
+		w = l.dst.width;
+		h = l.dst.height;
+		data = malloc((size_t)w * h * 4);
+		if (data && !resample_rgba_to_bgra(img_data, img_w, img_h,
+				l.scaled_w, l.scaled_h, l.dst.x - l.offset_x, l.dst.y - l.offset_y,
+				data, w, h, (size_t)w * 4, filter)) {
+			free(data);
+			data = NULL;
+		}
+	} else {
+		/* Centered or enlarged: the source pixels under the screen */
+		x0 = (int)floor(l.src.x);
+		y0 = (int)floor(l.src.y);
+		x1 = (int)ceil(l.src.x + l.src.width);
+		y1 = (int)ceil(l.src.y + l.src.height);
+		w = (x1 < img_w ? x1 : img_w) - x0;
+		h = (y1 < img_h ? y1 : img_h) - y0;
+		data = malloc((size_t)w * h * 4);
+		for (y = 0; data && y < h; y++)
+			pixel_swizzle(data + (size_t)y * w * 4,
+					img_data + ((size_t)(y0 + y) * img_w + x0) * 4, (size_t)w);
+		t->src = l.src;
+		t->src.x -= x0;
+		t->src.y -= y0;
 	}
+	t->data_width = w;
+	t->data_height = h;
+	return data;
+}
 
-	wlr_buffer_init(&buffer->base, &buffer_impl, wp.width, wp.height);
-	buffer->data = final_data;
-	buffer->format = DRM_FORMAT_ARGB8888;
-	buffer->stride = stride;
+/* mkdir -p */
+static int make_dirs(const char *path) {
+	char buf[MAX_PATH];
+	char *p;
 
-	if (wp.scene_buffer) {
-		wlr_scene_buffer_set_buffer(wp.scene_buffer, &buffer->base);
-		wlr_scene_buffer_set_dest_size(wp.scene_buffer, wp.width, wp.height);
+	snprintf(buf, sizeof(buf), "%s", path);
+	for (p = buf + 1; *p; p++) {
+		if (*p != '/')
+			continue;
+		*p = '\0';
+		if (mkdir(buf, 0755) < 0 && errno != EEXIST)
+			return 0;
+		*p = '/';
 	}
+	return mkdir(buf, 0755) == 0 || errno == EEXIST;
+}
 
-	if (wp.buffer)
-		wlr_buffer_drop(&wp.buffer->base);
-	wp.buffer = buffer;
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len) {
+	const unsigned char *p = data;
 
-	strncpy(wp.current_file, path, MAX_PATH - 1);
+	while (len--)
+		hash = (hash ^ *p++) * 0x100000001b3ULL;
+	return hash;
 }
 
-static void load_gradient_fallback(void) {
-	unsigned char *data;
-	size_t stride;
-	double angle_rad, cos_a, sin_a;
-	double max_proj;
-	int x, y;
-	WallpaperBuffer *buffer;
+/* Cache file for a target, named after the source's path, size and
+ * mtime and the scaling parameters */
+static void disk_cache_file(const WallpaperJob *job, const struct stat *st,
+		const JobTarget *t, char *out, size_t out_size) {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	int64_t key[] = {
+		st->st_size, st->st_mtim.tv_sec, st->st_mtim.tv_nsec,
+		t->width, t->height, job->scale_mode, job->filter,
+	};
 
-	if (wp.width == 0 || wp.height == 0)
-		return;
+	hash = fnv1a(hash, job->path, strlen(job->path));
+	hash = fnv1a(hash, key, sizeof(key));
+	snprintf(out, out_size, "%s/%016llx.bgra", wp.disk_cache_dir,
+			(unsigned long long)hash);
+}
 
-	stride = wp.width * 4;
-	data = calloc(1, stride * wp.height);
-	if (!data)
-		return;
+/* Map a cached scaled image into t, returns 0 on a miss */
+static int disk_cache_load(const char *file, JobTarget *t) {
+	const DiskCacheHeader *h;
+	struct stat st;
+	size_t size = sizeof(*h) + (size_t)t->width * 4 * t->height;
+	void *map;
+	int fd;
 
-	/* Convert angle to radians */
-	angle_rad = GRADIENT_ANGLE * M_PI / 180.0;
-	cos_a = cos(angle_rad);
-	sin_a = sin(angle_rad);
+	fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size != size) {
+		close(fd);
+		return 0;
+	}
 
-	/* Calculate max projection for normalization */
-	max_proj = fabs(wp.width * cos_a) + fabs(wp.height * sin_a);
+	map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	futimens(fd, NULL); /* age counts from the last use */
+	close(fd);
+	if (map == MAP_FAILED)
+		return 0;
+
+	h = map;
+	if (memcmp(h->magic, DISK_CACHE_MAGIC, sizeof(h->magic)) != 0
+			|| h->width != (uint32_t)t->width || h->height != (uint32_t)t->height
+			|| h->stride != (uint32_t)t->width * 4) {
+		munmap(map, size);
+		unlink(file);
+		return 0;
+	}
 
-	for (y = 0; y < wp.height; y++) {
-		for (x = 0; x < wp.width; x++) {
-			double proj, t;
-			unsigned char r, g, b, *pixel;
+	t->map = map;
+	t->map_size = size;
+	t->data = (unsigned char *)map + sizeof(*h);
+	t->opaque = (struct wlr_box){ h->opaque[0], h->opaque[1], h->opaque[2], h->opaque[3] };
+	return 1;
+}
 
-			/* Project point onto gradient axis */
-			proj = x * cos_a + y * sin_a;
-			t = (proj + max_proj / 2.0) / max_proj;
-
-			/* Clamp t to [0, 1] */
-			if (t < 0.0) t = 0.0;
-			if (t > 1.0) t = 1.0;
-
-			/* Interpolate colors */
-			r = (unsigned char)(GRADIENT_COLOR1_R + t * (GRADIENT_COLOR2_R - GRADIENT_COLOR1_R));
-			g = (unsigned char)(GRADIENT_COLOR1_G + t * (GRADIENT_COLOR2_G - GRADIENT_COLOR1_G));
-			b = (unsigned char)(GRADIENT_COLOR1_B + t * (GRADIENT_COLOR2_B - GRADIENT_COLOR1_B));
-
-			/* BGRA format */
-			pixel = data + (y * wp.width + x) * 4;
-			pixel[0] = b;
-			pixel[1] = g;
-			pixel[2] = r;
-			pixel[3] = 0xFF;
+/* Write t's pixels next to the final name and rename into place,
+ * returns the bytes stored */
+static size_t disk_cache_store(const char *file, const JobTarget *t) {
+	char tmp[MAX_PATH];
+	DiskCacheHeader h = {0};
+	FILE *f;
+	int ok;
+
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", file, (int)getpid());
+	f = fopen(tmp, "wb");
+	if (!f)
+		return 0;
+
+	memcpy(h.magic, DISK_CACHE_MAGIC, sizeof(h.magic));
+	h.width = t->width;
+	h.height = t->height;
+	h.stride = t->width * 4;
+	h.opaque[0] = t->opaque.x;
+	h.opaque[1] = t->opaque.y;
+	h.opaque[2] = t->opaque.width;
+	h.opaque[3] = t->opaque.height;
+	ok = fwrite(&h, sizeof(h), 1, f) == 1
+		&& fwrite(t->data, h.stride, t->height, f) == (size_t)t->height;
+	ok = fclose(f) == 0 && ok;
+
+	if (!ok || rename(tmp, file) < 0) {
+		unlink(tmp);
+		return 0;
+	}
+	return sizeof(h) + (size_t)h.stride * t->height;
+}
+
+typedef struct {
+	char name[32];
+	time_t mtime;
+	off_t size;
+} DiskCacheFile;
+
+static int disk_cache_file_cmp(const void *a, const void *b) {
+	const DiskCacheFile *fa = a, *fb = b;
+
+	return (fa->mtime > fb->mtime) - (fa->mtime < fb->mtime);
+}
+
+/* A name.<pid>.tmp file left by a write that never finished: one from
+ * another run, or one of ours older than DISK_CACHE_TMP_AGE */
+static int stale_tmp(const char *name, time_t mtime, time_t now) {
+	const char *end = strrchr(name, '.'), *pid;
+
+	if (!end || strcmp(end, ".tmp") != 0)
+		return 0;
+	for (pid = end; pid > name && pid[-1] != '.'; pid--)
+		;
+	if (pid == name || strtol(pid, NULL, 10) != (long)getpid())
+		return 1;
+	return now - mtime > DISK_CACHE_TMP_AGE;
+}
+
+/* Delete files with extension ext in path unused for too long, then the
+ * oldest ones over limit, and return the size of what is left. Stale
+ * temporary files are deleted along the way. */
+static size_t trim_dir(const char *path, const char *ext, size_t limit, time_t now) {
+	DIR *dir;
+	struct dirent *entry;
+	struct stat st;
+	DiskCacheFile *files = NULL, *tmp;
+	size_t count = 0, capacity = 0, total = 0, i;
+	const char *dot;
+
+	dir = opendir(path);
+	if (!dir)
+		return 0;
+
+	while ((entry = readdir(dir)) != NULL) {
+		dot = strrchr(entry->d_name, '.');
+		if (dot && strcmp(dot, ".tmp") == 0) {
+			if (fstatat(dirfd(dir), entry->d_name, &st, 0) == 0
+					&& stale_tmp(entry->d_name, st.st_mtime, now))
+				unlinkat(dirfd(dir), entry->d_name, 0);
+			continue;
+		}
+		if (!dot || strcmp(dot, ext) != 0
+				|| strlen(entry->d_name) >= sizeof(files->name))
+			continue;
+		if (fstatat(dirfd(dir), entry->d_name, &st, 0) < 0)
+			continue;
+
+		if (now - st.st_mtime > wp.disk_cache_max_age) {
+			unlinkat(dirfd(dir), entry->d_name, 0);
+			continue;
+		}
+
+		if (count >= capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			tmp = realloc(files, capacity * sizeof(*files));
+			if (!tmp)
+				break;
+			files = tmp;
+		}
+		strcpy(files[count].name, entry->d_name);
+		files[count].mtime = st.st_mtime;
+		files[count].size = st.st_size;
+		total += st.st_size;
+		count++;
+	}
+
+	if (total > limit) {
+		qsort(files, count, sizeof(*files), disk_cache_file_cmp);
+		for (i = 0; i < count && total > limit; i++) {
+			if (unlinkat(dirfd(dir), files[i].name, 0) == 0)
+				total -= files[i].size;
+		}
+	}
+
+	closedir(dir);
+	free(files);
+	return total;
+}
+
+/* Trim the scaled images and take what is left as the running total.
+ * Saved shader programs share the age limit but have their own size. */
+static void disk_cache_trim(void) {
+	time_t now = time(NULL);
+
+	wp.disk_cache_size = trim_dir(wp.disk_cache_dir, ".bgra", wp.disk_cache_limit, now);
+#ifdef EXTRAS
+	if (wp.program_cache_dir[0] != '\0')
+		trim_dir(wp.program_cache_dir, ".bin", PROGRAM_CACHE_DISK_LIMIT, now);
+#endif
+	wp.disk_cache_scanned = now;
+}
+
+/* Decode the job's image once and scale it for each target.
+ * Targets found in the disk cache skip decoding entirely. */
+static int is_gif(const char *path) {
+	const char *ext = strrchr(path, '.');
+
+	return ext && strcasecmp(ext, ".gif") == 0;
+}
+
+/* Map a whole file read-only, NULL if empty, unreadable or too large to
+ * hand to stb_image */
+static unsigned char *map_file(const char *path, size_t *size) {
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) != 0 || st.st_size <= 0 || st.st_size > INT_MAX) {
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+	*size = (size_t)st.st_size;
+	return map;
+}
+
+static int is_opaque(const unsigned char *rgba, size_t n) {
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		if (rgba[i * 4 + 3] != 0xff)
+			return 0;
+	return 1;
+}
+
+/* Count the frames of a GIF and read their delays without decoding any.
+ * A frame without a delay of its own keeps the one before, as in stb_image. */
+static int gif_scan(const unsigned char *p, size_t size, int **delays) {
+	size_t i = 13;
+	int count = 0, capacity = 0, delay = 0, *d = NULL, *tmp;
+
+	*delays = NULL;
+	if (size < 13 || memcmp(p, "GIF8", 4) != 0)
+		return 0;
+	if (p[10] & 0x80)
+		i += (size_t)3 << ((p[10] & 7) + 1);
+
+	while (i < size && p[i] != 0x3b) {
+		if (p[i] == 0x21 && i + 1 < size) {
+			/* Graphic control extension: size, flags, delay in 1/100 s */
+			if (p[i + 1] == 0xf9 && i + 5 < size && p[i + 2] >= 4)
+				delay = (p[i + 4] | p[i + 5] << 8) * 10;
+			i += 2;
+		} else if (p[i] == 0x2c && i + 10 < size) {
+			if (count >= capacity) {
+				capacity = capacity ? capacity * 2 : 16;
+				tmp = realloc(d, (size_t)capacity * sizeof(*d));
+				if (!tmp)
+					break;
+				d = tmp;
+			}
+			d[count++] = delay;
+			/* Descriptor, local color table and LZW code size */
+			i += 11;
+			if (p[i - 2] & 0x80)
+				i += (size_t)3 << ((p[i - 2] & 7) + 1);
+		} else {
+			break;
+		}
+		/* Data sub-blocks up to an empty one */
+		while (i < size && p[i] != 0)
+			i += (size_t)p[i] + 1;
+		i++;
+	}
+
+	*delays = d;
+	return count;
+}
+
+static GifStream *gif_open(const char *path) {
+	GifStream *gs;
+
+	gs = calloc(1, sizeof(*gs));
+	if (!gs)
+		return NULL;
+	gs->file = map_file(path, &gs->size);
+	if (!gs->file) {
+		free(gs);
+		return NULL;
+	}
+	gs->count = gif_scan(gs->file, gs->size, &gs->delays);
+	stbi__start_mem(&gs->ctx, gs->file, (int)gs->size);
+	return gs;
+}
+
+static void gif_rewind(GifStream *gs) {
+	free(gs->gif.out);
+	free(gs->gif.background);
+	free(gs->gif.history);
+	memset(&gs->gif, 0, sizeof(gs->gif));
+	free(gs->prev);
+	free(gs->two_back);
+	gs->prev = gs->two_back = NULL;
+	stbi__start_mem(&gs->ctx, gs->file, (int)gs->size);
+	gs->pos = 0;
+}
+
+static void gif_close(GifStream *gs) {
+	if (!gs)
+		return;
+	gif_rewind(gs);
+	munmap(gs->file, gs->size);
+	free(gs->delays);
+	free(gs);
+}
+
+static void free_frames(unsigned char **frames, int count) {
+	int k;
+
+	if (!frames)
+		return;
+	for (k = 0; k < count; k++)
+		free(frames[k]);
+	free(frames);
+}
+
+/* Free a target's pixels, whether decoded or mapped from disk */
+static void free_target_data(JobTarget *t, int nframes) {
+	if (t->map)
+		munmap(t->map, t->map_size);
+	else
+		free(t->data);
+	free_frames(t->frames, nframes);
+	gif_close(t->stream);
+	t->data = NULL;
+	t->map = NULL;
+	t->frames = NULL;
+	t->stream = NULL;
+}
+
+/* Decode the next frame as RGBA, owned by the stream until the one after.
+ * NULL at the end or on damaged data. */
+static unsigned char *gif_next(GifStream *gs) {
+	unsigned char *frame, *tmp;
+	size_t frame_size;
+	int comp;
+
+	frame = stbi__gif_load_next(&gs->ctx, &gs->gif, &comp, 4, gs->two_back);
+	if (!frame || frame == (unsigned char *)&gs->ctx)
+		return NULL;
+	gs->pos++;
+
+	/* The frame after may be disposed to this one's predecessor */
+	if (gs->count > 1) {
+		frame_size = (size_t)gs->gif.w * gs->gif.h * 4;
+		tmp = gs->two_back;
+		gs->two_back = gs->prev;
+		gs->prev = tmp ? tmp : malloc(frame_size);
+		if (gs->prev)
+			memcpy(gs->prev, frame, frame_size);
+	}
+	return frame;
+}
+
+/* Decode frame k, starting over if it was passed already */
+static unsigned char *gif_frame(GifStream *gs, int k) {
+	unsigned char *frame = NULL;
+
+	if (k < gs->pos)
+		gif_rewind(gs);
+	while (gs->pos <= k)
+		if (!(frame = gif_next(gs)))
+			return NULL;
+	return frame;
+}
+
+/* Frame of a streamed animation: tiled at width x height, else BGRA at
+ * source size for the scene to place */
+static unsigned char *stream_frame(const unsigned char *frame, int img_w, int img_h,
+		int width, int height, int scale_mode) {
+	unsigned char *data;
+
+	if (scale_mode == SCALE_TILE)
+		return scale_image(frame, img_w, img_h, width, height, SCALE_TILE, 0);
+	data = malloc((size_t)img_w * img_h * 4);
+	if (data)
+		pixel_swizzle(data, frame, (size_t)img_w * img_h);
+	return data;
+}
+
+/* Make an animation's frames for every target, decoding one frame at a
+ * time so no more than the memory budget is ever kept. Targets get frames
+ * scaled for them while those fit, else the source frames the scene
+ * scales, shared by all of them. Targets over budget, or tiled ones past
+ * scaled frames, only get the first frame and a stream of their own to
+ * decode the rest as they play. With scene scaling no target takes
+ * scaled frames. */
+static void scale_animation(WallpaperJob *job, GifStream *gs, unsigned char *frame) {
+	int img_w = gs->gif.w, img_h = gs->gif.h;
+	size_t frame_size = (size_t)img_w * img_h * 4;
+	size_t budget = wp.anim_limit, need;
+	int decode = 0, ok, i, k;
+
+	job->frame_width = img_w;
+	job->frame_height = img_h;
+	for (i = 0; i < job->ntargets; i++) {
+		JobTarget *t = &job->targets[i];
+
+		if (t->data)
+			continue;
+		need = (size_t)job->nframes * t->width * t->height * 4;
+		if (!job->scene_scale && need <= budget
+				&& (t->frames = calloc((size_t)job->nframes, sizeof(*t->frames)))) {
+			budget -= need;
+			decode = 1;
+			continue;
+		}
+
+		need = (size_t)job->nframes * frame_size;
+		if (job->scale_mode != SCALE_TILE && !job->frames && need <= budget
+				&& (job->frames = calloc((size_t)job->nframes, sizeof(*job->frames))))
+			budget -= need;
+		if (job->frames) {
+			t->source_frames = 1;
+			decode = 1;
+			continue;
+		}
+
+		t->stream = gif_open(job->path);
+	}
+
+	for (k = 0; k < job->nframes; k++) {
+		if (k > 0 && (!decode || !(frame = gif_next(gs))))
+			break;
+
+		ok = 1;
+		for (i = 0; i < job->ntargets; i++) {
+			JobTarget *t = &job->targets[i];
+
+			if (t->frames) {
+				t->frames[k] = scale_image(frame, img_w, img_h,
+						t->width, t->height, job->scale_mode, job->filter);
+				ok = ok && t->frames[k];
+			} else if (k == 0 && t->stream) {
+				t->data = stream_frame(frame, img_w, img_h,
+						t->width, t->height, job->scale_mode);
+			}
+		}
+		if (job->frames) {
+			job->frames[k] = malloc(frame_size);
+			if (job->frames[k])
+				pixel_swizzle(job->frames[k], frame, (size_t)img_w * img_h);
+			ok = ok && job->frames[k];
+		}
+		if (ok)
+			continue;
+
+		/* Out of memory: play the frames made so far */
+		for (i = 0; i < job->ntargets; i++) {
+			if (job->targets[i].frames) {
+				free(job->targets[i].frames[k]);
+				job->targets[i].frames[k] = NULL;
+			}
+		}
+		if (job->frames) {
+			free(job->frames[k]);
+			job->frames[k] = NULL;
+		}
+		break;
+	}
+
+	/* Damaged or out of memory before the last frame */
+	if (decode && k < job->nframes) {
+		job->nframes = k;
+		if (k > 0)
+			return;
+		for (i = 0; i < job->ntargets; i++) {
+			free_target_data(&job->targets[i], 0);
+			job->targets[i].source_frames = 0;
+		}
+		free(job->frames);
+		job->frames = NULL;
+	}
+}
+
+/* Decode a GIF from a mapping of its file. An animation is made into
+ * frames for the targets right here; a still GIF's only frame is returned
+ * as load_image would. Free the result with stbi_image_free. */
+static unsigned char *load_gif(WallpaperJob *job, int *width, int *height,
+		int *opaque) {
+	unsigned char *frame;
+	GifStream *gs;
+	int k;
+
+	gs = gif_open(job->path);
+	if (!gs)
+		return NULL;
+
+	frame = gif_next(gs);
+	if (frame && gs->count > 1) {
+		for (k = 0; k < gs->count; k++)
+			if (gs->delays[k] < ANIM_MIN_DELAY_MS)
+				gs->delays[k] = ANIM_DEFAULT_DELAY_MS;
+		job->nframes = gs->count;
+		job->delays = gs->delays;
+		gs->delays = NULL;
+		scale_animation(job, gs, frame);
+		frame = NULL;
+	} else if (frame) {
+		/* Take the decoder's buffer instead of decoding it again */
+		*width = gs->gif.w;
+		*height = gs->gif.h;
+		*opaque = is_opaque(frame, (size_t)*width * *height);
+		gs->gif.out = NULL;
+	}
+	gif_close(gs);
+	return frame;
+}
+
+#ifdef JPEG_SCALE
+/* Fraction of the source resolution that still has to be scaled down,
+ * not up, for every target still missing */
+static float needed_scale(const WallpaperJob *job, int img_w, int img_h) {
+	float need = 0.0f, sx, sy, s;
+	int i;
+
+	if (job->scale_mode == SCALE_TILE || job->scale_mode == SCALE_CENTER)
+		return 1.0f;
+	for (i = 0; i < job->ntargets; i++) {
+		const JobTarget *t = &job->targets[i];
+		if (t->data)
+			continue;
+		sx = (float)t->width / (float)img_w;
+		sy = (float)t->height / (float)img_h;
+		if (job->scale_mode == SCALE_FIT)
+			s = sx < sy ? sx : sy;
+		else
+			s = sx > sy ? sx : sy;
+		if (s > need)
+			need = s;
+	}
+	return need;
+}
+
+/* Decode a JPEG at the smallest DCT scale that is still at least as large
+ * as the targets need, so huge photos never exist at full size */
+static unsigned char *load_jpeg_scaled(const WallpaperJob *job,
+		const unsigned char *file, size_t size, int *width, int *height) {
+	tjhandle tj;
+	tjscalingfactor *factors, best = { 1, 1 };
+	unsigned char *data = NULL;
+	int nfactors, subsamp, colorspace, src_w, src_h, i;
+	float need;
+
+	tj = tjInitDecompress();
+	if (!tj)
+		return NULL;
+	if (tjDecompressHeader3(tj, file, (unsigned long)size, &src_w, &src_h,
+			&subsamp, &colorspace) != 0
+			|| !(factors = tjGetScalingFactors(&nfactors))) {
+		tjDestroy(tj);
+		return NULL;
+	}
+
+	need = needed_scale(job, src_w, src_h);
+	for (i = 0; i < nfactors; i++) {
+		float f = (float)factors[i].num / (float)factors[i].denom;
+		if (f >= need && f < (float)best.num / (float)best.denom)
+			best = factors[i];
+	}
+
+	*width = TJSCALED(src_w, best);
+	*height = TJSCALED(src_h, best);
+	data = malloc((size_t)*width * *height * 4);
+	if (data && tjDecompress2(tj, file, (unsigned long)size, data,
+			*width, 0, *height, TJPF_RGBA, 0) != 0) {
+		free(data);
+		data = NULL;
+	}
+	tjDestroy(tj);
+	return data;
+}
+#endif
+
+/* Decode an image to RGBA from a mapping of its file, instead of reading
+ * it through stdio, and tell if it has no transparent pixels.
+ * Free the result with stbi_image_free. */
+static unsigned char *load_image(const WallpaperJob *job, int *width, int *height,
+		int *opaque) {
+	unsigned char *file, *data = NULL;
+	size_t size;
+	int channels = 4;
+
+	file = map_file(job->path, &size);
+	if (!file) {
+		data = stbi_load(job->path, width, height, &channels, 4);
+	} else {
+#ifdef JPEG_SCALE
+		if (size > 2 && file[0] == 0xff && file[1] == 0xd8
+				&& (data = load_jpeg_scaled(job, file, size, width, height)))
+			channels = 3;
+#endif
+		if (!data)
+			data = stbi_load_from_memory(file, (int)size, width, height, &channels, 4);
+		munmap(file, size);
+	}
+
+	/* Only gray and RGB have no alpha to check */
+	*opaque = data && (channels == 1 || channels == 3
+			|| is_opaque(data, (size_t)*width * *height));
+	return data;
+}
+
+/* Part of t's pixels an opaque source image covers: all of them when
+ * placed by the scene or tiled, else the image without its border */
+static struct wlr_box opaque_box(const WallpaperJob *job, const JobTarget *t,
+		int img_w, int img_h) {
+	Layout l;
+
+	if (t->dst.width > 0)
+		return (struct wlr_box){ 0, 0, t->data_width, t->data_height };
+	if (job->scale_mode == SCALE_TILE)
+		return (struct wlr_box){ 0, 0, t->width, t->height };
+	layout_image(&l, t->width, t->height, img_w, img_h, job->scale_mode);
+	return l.dst;
+}
+
+/* Decode the frame of a streamed animation its output shows next. Only
+ * one job at a time has the stream, see request_frame. */
+static void run_frame_job(WallpaperJob *job) {
+	GifStream *gs = job->anim->stream;
+	JobTarget *t = &job->targets[0];
+	unsigned char *frame;
+
+	frame = gif_frame(gs, job->frame);
+	if (frame)
+		t->data = stream_frame(frame, gs->gif.w, gs->gif.h,
+				t->width, t->height, job->scale_mode);
+}
+
+static void run_job(WallpaperJob *job) {
+	char file[MAX_PATH];
+	int img_w, img_h;
+	unsigned char *img_data;
+	struct stat st;
+	int use_disk, missing = 0;
+	size_t stored = 0;
+	int opaque, i;
+
+	if (job->anim) {
+		run_frame_job(job);
+		return;
+	}
+
+	/* The disk cache only holds full-output images */
+	use_disk = wp.disk_cache_dir[0] != '\0' && !job->scene_scale
+		&& stat(job->path, &st) == 0;
+	for (i = 0; i < job->ntargets; i++) {
+		JobTarget *t = &job->targets[i];
+		if (use_disk) {
+			disk_cache_file(job, &st, t, file, sizeof(file));
+			if (disk_cache_load(file, t))
+				continue;
+		}
+		missing++;
+	}
+	if (!missing)
+		return;
+
+	/* Animations skip the disk cache, it only holds single frames */
+	if (is_gif(job->path)) {
+		img_data = load_gif(job, &img_w, &img_h, &opaque);
+		if (job->nframes)
+			return;
+	} else {
+		img_data = load_image(job, &img_w, &img_h, &opaque);
+	}
+	if (!img_data)
+		return;
+
+	for (i = 0; i < job->ntargets; i++) {
+		JobTarget *t = &job->targets[i];
+		if (t->data)
+			continue;
+		if (job->scene_scale)
+			t->data = scene_image(img_data, img_w, img_h, t,
+					job->scale_mode, job->filter);
+		else
+			t->data = scale_image(img_data, img_w, img_h, t->width, t->height,
+					job->scale_mode, job->filter);
+		if (opaque && t->data)
+			t->opaque = opaque_box(job, t, img_w, img_h);
+		if (use_disk && t->data) {
+			disk_cache_file(job, &st, t, file, sizeof(file));
+			stored += disk_cache_store(file, t);
 		}
 	}
 
-	/* Create new buffer */
+	stbi_image_free(img_data);
+
+	/* Rescanning is only needed once the running total is over budget */
+	wp.disk_cache_size += stored;
+	if (wp.disk_cache_size > wp.disk_cache_limit)
+		disk_cache_trim();
+}
+
+static void free_job(WallpaperJob *job) {
+	int i;
+
+	if (job == wp.prefetch_job)
+		wp.prefetch_job = NULL;
+	for (i = 0; i < job->ntargets; i++)
+		free_target_data(&job->targets[i], job->nframes);
+	free_frames(job->frames, job->nframes);
+	free(job->delays);
+	if (job->anim)
+		animation_unref(job->anim);
+	free(job);
+}
+
+static WallpaperOutput *find_output(struct wlr_output *output) {
+	WallpaperOutput *o;
+
+	wl_list_for_each(o, &wp.outputs, link)
+		if (o->output == output)
+			return o;
+	return NULL;
+}
+
+static WallpaperOutput *find_output_id(unsigned int id) {
+	WallpaperOutput *o;
+
+	wl_list_for_each(o, &wp.outputs, link)
+		if (o->id == id)
+			return o;
+	return NULL;
+}
+
+/* Wrap BGRA pixels in a wlr_buffer. Takes ownership of data; the caller
+ * owns the returned buffer until it drops it or hands it to the cache. */
+static WallpaperBuffer *create_buffer(unsigned char *data, int width, int height) {
+	WallpaperBuffer *buffer;
+
 	buffer = calloc(1, sizeof(WallpaperBuffer));
 	if (!buffer) {
 		free(data);
+		return NULL;
+	}
+
+	wlr_buffer_init(&buffer->base, &buffer_impl, width, height);
+	buffer->data = data;
+	buffer->format = DRM_FORMAT_ARGB8888;
+	buffer->stride = width * 4;
+	buffer->out_width = width;
+	buffer->out_height = height;
+	return buffer;
+}
+
+/* Note the part of a buffer without alpha. All of it is published as
+ * XRGB, so the scene can skip what is underneath without blending. */
+static void set_buffer_opaque(WallpaperBuffer *buffer, const struct wlr_box *opaque) {
+	buffer->opaque = *opaque;
+	if (opaque->x == 0 && opaque->y == 0 && opaque->width == buffer->base.width
+			&& opaque->height == buffer->base.height)
+		buffer->format = DRM_FORMAT_XRGB8888;
+}
+
+/* Wrap a finished target's pixels, taking them over from the job */
+static WallpaperBuffer *create_target_buffer(JobTarget *t) {
+	WallpaperBuffer *buffer;
+
+	if (t->dst.width > 0) {
+		buffer = create_buffer(t->data, t->data_width, t->data_height);
+		t->data = NULL;
+		if (buffer) {
+			buffer->src = t->src;
+			buffer->dst = t->dst;
+			buffer->out_width = t->width;
+			buffer->out_height = t->height;
+			set_buffer_opaque(buffer, &t->opaque);
+		}
+		return buffer;
+	}
+	if (!t->map) {
+		buffer = create_buffer(t->data, t->width, t->height);
+		t->data = NULL;
+		if (buffer)
+			set_buffer_opaque(buffer, &t->opaque);
+		return buffer;
+	}
+
+	buffer = calloc(1, sizeof(WallpaperBuffer));
+	if (!buffer) {
+		free_target_data(t, 0);
+		return NULL;
+	}
+
+	wlr_buffer_init(&buffer->base, &buffer_impl, t->width, t->height);
+	buffer->data = t->data;
+	buffer->format = DRM_FORMAT_ARGB8888;
+	buffer->stride = t->width * 4;
+	buffer->out_width = t->width;
+	buffer->out_height = t->height;
+	buffer->map = t->map;
+	buffer->map_size = t->map_size;
+	set_buffer_opaque(buffer, &t->opaque);
+	t->data = NULL;
+	t->map = NULL;
+	return buffer;
+}
+
+static long ms_since(const struct timespec *t) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - t->tv_sec) * 1000 + (now.tv_nsec - t->tv_nsec) / 1000000;
+}
+
+/* Show the src part of sb's buffer, all of it if NULL, over the dst box
+ * of the output, given in output pixels */
+static void place_box(WallpaperOutput *o, struct wlr_scene_buffer *sb,
+		const struct wlr_fbox *src, const struct wlr_box *dst) {
+	float to_logical = (float)o->width / (float)o->buf_width;
+
+	wlr_scene_buffer_set_source_box(sb, src);
+	wlr_scene_buffer_set_dest_size(sb,
+			(int)((float)dst->width * to_logical + 0.5f),
+			(int)((float)dst->height * to_logical + 0.5f));
+	wlr_scene_node_set_position(&sb->node,
+			o->x + (int)((float)dst->x * to_logical + 0.5f),
+			o->y + (int)((float)dst->y * to_logical + 0.5f));
+}
+
+/* Show buffer where it was made to go, stretched over the output if it
+ * has no placement or is NULL */
+static void place_buffer(WallpaperOutput *o, struct wlr_scene_buffer *sb,
+		const WallpaperBuffer *buffer) {
+	float to_logical = (float)o->width / (float)o->buf_width;
+	pixman_region32_t opaque;
+
+	if (buffer && buffer->dst.width > 0) {
+		place_box(o, sb, buffer->src.width > 0 ? &buffer->src : NULL, &buffer->dst);
+		return;
+	}
+	wlr_scene_buffer_set_source_box(sb, NULL);
+	wlr_scene_buffer_set_dest_size(sb, o->width, o->height);
+	wlr_scene_node_set_position(&sb->node, o->x, o->y);
+
+	/* XRGB buffers are opaque already; this covers images with a border */
+	if (buffer && buffer->format != DRM_FORMAT_XRGB8888 && buffer->opaque.width > 0)
+		pixman_region32_init_rect(&opaque,
+				(int)((float)buffer->opaque.x * to_logical + 0.5f),
+				(int)((float)buffer->opaque.y * to_logical + 0.5f),
+				(unsigned int)((float)buffer->opaque.width * to_logical),
+				(unsigned int)((float)buffer->opaque.height * to_logical));
+	else
+		pixman_region32_init(&opaque);
+	wlr_scene_buffer_set_opaque_region(sb, &opaque);
+	pixman_region32_fini(&opaque);
+}
+
+/* Show the new wallpaper whole and drop the old one */
+static void end_transition(WallpaperOutput *o) {
+	if (!o->old_scene)
+		return;
+	wlr_scene_node_destroy(&o->old_scene->node);
+	o->old_scene = NULL;
+	wlr_buffer_unlock(&o->old->base);
+	o->old = NULL;
+
+	place_buffer(o, o->scene_buffer, o->buffer);
+	wlr_scene_node_set_enabled(&o->scene_buffer->node, true);
+}
+
+/* Crop a scene buffer to the columns [from, to) of its buffer, given as
+ * fractions of the width, and place them at fraction at of the output */
+static void show_columns(WallpaperOutput *o, struct wlr_scene_buffer *sb,
+		const struct wlr_buffer *buffer, float from, float to, float at) {
+	struct wlr_fbox src = {
+		.x = (double)from * buffer->width,
+		.y = 0,
+		.width = (double)(to - from) * buffer->width,
+		.height = buffer->height,
+	};
+	int x = (int)((float)o->width * at + 0.5f);
+	int width = (int)((float)o->width * (at + to - from) + 0.5f) - x;
+
+	/* A zero dest size would mean the buffer's own size */
+	wlr_scene_node_set_enabled(&sb->node, width > 0);
+	if (width <= 0)
+		return;
+	wlr_scene_buffer_set_source_box(sb, &src);
+	wlr_scene_buffer_set_dest_size(sb, width, o->height);
+	wlr_scene_node_set_position(&sb->node, o->x + x, o->y);
+}
+
+/* Move a transition to time t in [0, 1]. Only scene state changes and the
+ * renderer does the blending, so every step costs the same. */
+static void step_transition(WallpaperOutput *o, float t) {
+	float p = t * t * (3.0f - 2.0f * t); /* ease in and out */
+
+	switch (o->transition) {
+	case WallpaperTransitionFade:
+		wlr_scene_buffer_set_opacity(o->old_scene, 1.0f - p);
+		break;
+	case WallpaperTransitionWipe:
+		show_columns(o, o->old_scene, &o->old->base, p, 1.0f, p);
+		break;
+	case WallpaperTransitionSlide:
+		show_columns(o, o->old_scene, &o->old->base, p, 1.0f, 0.0f);
+		show_columns(o, o->scene_buffer, &o->buffer->base, 0.0f, p, 1.0f - p);
+		break;
+	}
+}
+
+static int transition_callback(void *data) {
+	WallpaperOutput *o;
+	float t;
+	int running = 0;
+
+	wl_list_for_each(o, &wp.outputs, link) {
+		if (!o->old_scene)
+			continue;
+		t = (float)ms_since(&o->transition_start) / (float)wp.transition_ms;
+		if (t >= 1.0f) {
+			end_transition(o);
+			continue;
+		}
+		step_transition(o, t);
+		running = 1;
+	}
+
+	if (running)
+		wl_event_source_timer_update(wp.transition_timer, TRANSITION_FRAME_MS);
+	return 0;
+}
+
+/* Keep the old wallpaper next to or above the new one and animate it out */
+static void start_transition(WallpaperOutput *o, WallpaperBuffer *old) {
+	if (wp.transition == WallpaperTransitionNone || wp.transition_ms <= 0
+			|| !wp.transition_timer)
+		return;
+
+	o->old_scene = wlr_scene_buffer_create(wp.tree, &old->base);
+	if (!o->old_scene)
 		return;
+	wlr_buffer_lock(&old->base);
+	o->old = old;
+	place_buffer(o, o->old_scene, old);
+
+	/* Wipe and slide cut columns of full-output buffers */
+	o->transition = wp.transition;
+	if (old->dst.width > 0 || o->buffer->dst.width > 0)
+		o->transition = WallpaperTransitionFade;
+	clock_gettime(CLOCK_MONOTONIC, &o->transition_start);
+	step_transition(o, 0.0f);
+	wl_event_source_timer_update(wp.transition_timer, TRANSITION_FRAME_MS);
+}
+
+static void animation_unref(Animation *anim) {
+	int k;
+
+	if (--anim->refs > 0)
+		return;
+	for (k = 0; k < anim->count; k++)
+		if (anim->frames[k])
+			wlr_buffer_drop(&anim->frames[k]->base);
+	gif_close(anim->stream);
+	free(anim->frames);
+	free(anim->delays);
+	free(anim);
+}
+
+/* Wrap decoded frames in buffers, taking over the pixels. With a stream
+ * only the first frame is given, and the animation takes the stream. */
+static Animation *animation_create(unsigned char **frames, int count,
+		const int *delays, int width, int height, int scaled, int scale_mode,
+		GifStream *stream) {
+	Animation *anim;
+	int k;
+
+	anim = calloc(1, sizeof(*anim));
+	if (!anim)
+		return NULL;
+	anim->refs = 1;
+	anim->count = count;
+	anim->scaled = scaled;
+	anim->scale_mode = scale_mode;
+	anim->width = width;
+	anim->height = height;
+	anim->decoding = -1;
+	anim->frames = calloc((size_t)count, sizeof(*anim->frames));
+	anim->delays = malloc((size_t)count * sizeof(*anim->delays));
+	if (!anim->frames || !anim->delays) {
+		animation_unref(anim);
+		return NULL;
+	}
+	memcpy(anim->delays, delays, (size_t)count * sizeof(*anim->delays));
+	for (k = 0; k < (stream ? 1 : count); k++) {
+		anim->frames[k] = create_buffer(frames[k], width, height);
+		frames[k] = NULL;
+		if (!anim->frames[k]) {
+			animation_unref(anim);
+			return NULL;
+		}
+	}
+	anim->stream = stream;
+	return anim;
+}
+
+/* Place a source-size frame where scale_image would have drawn it and
+ * let the scene scale it */
+static void place_frame(WallpaperOutput *o, const struct wlr_buffer *frame,
+		int scale_mode) {
+	Layout l;
+
+	layout_image(&l, o->buf_width, o->buf_height, frame->width, frame->height,
+			scale_mode);
+	place_box(o, o->scene_buffer, &l.src, &l.dst);
+}
+
+static void stop_animation(WallpaperOutput *o) {
+	if (!o->anim)
+		return;
+	if (!o->anim->scaled)
+		place_buffer(o, o->scene_buffer, NULL);
+	animation_unref(o->anim);
+	o->anim = NULL;
+}
+
+/* Show the next frame of the output's animation */
+static void show_frame(WallpaperOutput *o) {
+	WallpaperBuffer *frame = o->anim->frames[o->anim_pos];
+
+	wlr_buffer_lock(&frame->base);
+	wlr_scene_buffer_set_buffer(o->scene_buffer, &frame->base);
+	if (o->buffer)
+		wlr_buffer_unlock(&o->buffer->base);
+	o->buffer = frame;
+}
+
+/* Swap buffer into the output's scene buffer, keeping it locked while shown */
+static void show_output_buffer(WallpaperOutput *o, WallpaperBuffer *buffer) {
+	WallpaperBuffer *old = o->buffer;
+	int animate = old && old != buffer && !(o->anim && !o->anim->scaled);
+
+#ifdef EXTRAS
+	/* Shader frames follow each other directly */
+	if (wp.is_shader)
+		animate = 0;
+#endif
+
+	wlr_buffer_lock(&buffer->base);
+	end_transition(o);
+	stop_animation(o);
+	wlr_scene_buffer_set_buffer(o->scene_buffer, &buffer->base);
+	wlr_scene_buffer_set_transform(o->scene_buffer, WL_OUTPUT_TRANSFORM_NORMAL);
+	place_buffer(o, o->scene_buffer, buffer);
+	o->buffer = buffer;
+
+	if (animate)
+		start_transition(o, old);
+	if (old)
+		wlr_buffer_unlock(&old->base);
+}
+
+static void arm_animation_timer(void) {
+	WallpaperOutput *o;
+	struct timespec now;
+	long delay, next = -1;
+
+	if (!wp.anim_timer)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	wl_list_for_each(o, &wp.outputs, link) {
+		if (!o->anim || o->anim->waiting || activity_hidden(o->output))
+			continue;
+		delay = (o->anim_next.tv_sec - now.tv_sec) * 1000
+			+ (o->anim_next.tv_nsec - now.tv_nsec) / 1000000;
+		if (next < 0 || delay < next)
+			next = delay;
+	}
+	if (next >= 0)
+		wl_event_source_timer_update(wp.anim_timer, next > 1 ? (int)next : 1);
+}
+
+static void add_ms(struct timespec *t, int ms) {
+	t->tv_sec += ms / 1000;
+	t->tv_nsec += (long)(ms % 1000) * 1000000;
+	if (t->tv_nsec >= 1000000000) {
+		t->tv_sec++;
+		t->tv_nsec -= 1000000000;
+	}
+}
+
+/* Have the worker decode the frame after the one o shows, if its
+ * animation is streamed and the frame is neither there nor on its way */
+static void request_frame(WallpaperOutput *o) {
+	Animation *anim = o->anim;
+	WallpaperJob *job;
+	int next;
+
+	if (!anim->stream || anim->decoding >= 0)
+		return;
+	next = (o->anim_pos + 1) % anim->count;
+	if (anim->frames[next])
+		return;
+
+	job = calloc(1, sizeof(*job) + sizeof(JobTarget));
+	if (!job)
+		return;
+	job->anim = anim;
+	job->frame = next;
+	job->scale_mode = anim->scaled ? SCALE_TILE : anim->scale_mode;
+	job->ntargets = 1;
+	job->targets[0].width = anim->width;
+	job->targets[0].height = anim->height;
+	anim->refs++;
+	anim->decoding = next;
+	queue_job(job);
+}
+
+/* Show o's next frame, returns 0 if it is a streamed one still being
+ * decoded. Streamed frames are dropped once the next one shows. */
+static int advance_animation(WallpaperOutput *o) {
+	Animation *anim = o->anim;
+	int prev = o->anim_pos, next = (prev + 1) % anim->count;
+
+	if (!anim->frames[next]) {
+		anim->waiting = 1;
+		request_frame(o);
+		return 0;
+	}
+	anim->waiting = 0;
+	o->anim_pos = next;
+	show_frame(o);
+	if (anim->stream && prev != next) {
+		wlr_buffer_drop(&anim->frames[prev]->base);
+		anim->frames[prev] = NULL;
+	}
+	request_frame(o);
+	return 1;
+}
+
+/* Show the first frame, the rest follow at their own delays */
+static void start_animation(WallpaperOutput *o, Animation *anim) {
+	show_output_buffer(o, anim->frames[0]);
+	if (!anim->scaled) {
+		end_transition(o);
+		place_frame(o, &anim->frames[0]->base, anim->scale_mode);
+	}
+	anim->refs++;
+	o->anim = anim;
+	o->anim_pos = 0;
+	clock_gettime(CLOCK_MONOTONIC, &o->anim_next);
+	add_ms(&o->anim_next, anim->delays[0]);
+	request_frame(o);
+	arm_animation_timer();
+}
+
+static int animation_callback(void *data) {
+	WallpaperOutput *o;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	wl_list_for_each(o, &wp.outputs, link) {
+		if (!o->anim || o->anim->waiting || activity_hidden(o->output)
+				|| now.tv_sec < o->anim_next.tv_sec
+				|| (now.tv_sec == o->anim_next.tv_sec
+				&& now.tv_nsec < o->anim_next.tv_nsec))
+			continue;
+		if (!advance_animation(o))
+			continue;
+
+		/* Keep the native pace, but don't rush to catch up after a stall */
+		add_ms(&o->anim_next, o->anim->delays[o->anim_pos]);
+		if (ms_since(&o->anim_next) > 0) {
+			o->anim_next = now;
+			add_ms(&o->anim_next, o->anim->delays[o->anim_pos]);
+		}
+	}
+	arm_animation_timer();
+	return 0;
+}
+
+/* Wrap BGRA pixels and show them in one step. Takes ownership of data. */
+static void set_output_data(WallpaperOutput *o, unsigned char *data,
+		int width, int height, const struct wlr_box *opaque) {
+	WallpaperBuffer *buffer = create_buffer(data, width, height);
+
+	if (buffer) {
+		if (opaque)
+			set_buffer_opaque(buffer, opaque);
+		show_output_buffer(o, buffer);
+		wlr_buffer_drop(&buffer->base);
+	}
+}
+
+static void stage_output_buffer(WallpaperOutput *o, WallpaperBuffer *buffer) {
+	wlr_buffer_lock(&buffer->base);
+	if (o->staged)
+		wlr_buffer_unlock(&o->staged->base);
+	o->staged = buffer;
+}
+
+static void drop_staged(WallpaperOutput *o) {
+	if (o->staged) {
+		wlr_buffer_unlock(&o->staged->base);
+		o->staged = NULL;
+	}
+}
+
+static void cache_free_entry(CacheEntry *e) {
+	wl_list_remove(&e->link);
+	wp.cache_size -= e->buffer->stride * e->buffer->base.height;
+	wlr_buffer_drop(&e->buffer->base);
+	free(e->path);
+	free(e);
+}
+
+/* Drop least recently used entries until extra more bytes fit the budget */
+static void cache_trim(size_t extra) {
+	while (!wl_list_empty(&wp.cache) && wp.cache_size + extra > wp.cache_limit) {
+		CacheEntry *e = wl_container_of(wp.cache.prev, e, link);
+		cache_free_entry(e);
+	}
+}
+
+static WallpaperBuffer *cache_get(const char *path, int width, int height,
+		int scale_mode, int filter) {
+	CacheEntry *e;
+
+	wl_list_for_each(e, &wp.cache, link) {
+		if (e->width == width && e->height == height
+				&& e->scale_mode == scale_mode && e->filter == filter
+				&& strcmp(e->path, path) == 0) {
+			wl_list_remove(&e->link);
+			wl_list_insert(&wp.cache, &e->link);
+			return e->buffer;
+		}
+	}
+	return NULL;
+}
+
+/* Hand a freshly created buffer to the cache. Takes the caller's
+ * reference; lock the buffer first to keep using it. */
+static void cache_put(const char *path, int scale_mode, int filter,
+		WallpaperBuffer *buffer) {
+	size_t size = buffer->stride * buffer->base.height;
+	CacheEntry *e;
+
+	if (size > wp.cache_limit || !(e = calloc(1, sizeof(*e)))) {
+		wlr_buffer_drop(&buffer->base);
+		return;
+	}
+	if (!(e->path = strdup(path))) {
+		free(e);
+		wlr_buffer_drop(&buffer->base);
+		return;
+	}
+
+	e->width = buffer->out_width;
+	e->height = buffer->out_height;
+	e->scale_mode = scale_mode;
+	e->filter = filter;
+	e->buffer = buffer;
+
+	cache_trim(size);
+	wl_list_insert(&wp.cache, &e->link);
+	wp.cache_size += size;
+}
+
+static void cache_clear(void) {
+	while (!wl_list_empty(&wp.cache)) {
+		CacheEntry *e = wl_container_of(wp.cache.next, e, link);
+		cache_free_entry(e);
+	}
+}
+
+/* Remember path as the newest history entry, forgetting entries ahead
+ * of the current one */
+static void history_push(const char *path) {
+	HistoryEntry *h;
+	char *copy = strdup(path);
+
+	if (!copy)
+		return;
+
+	while (wp.history_len > wp.history_pos + 1) {
+		wp.history_len--;
+		h = &wp.history[(wp.history_start + wp.history_len) % HISTORY_SIZE];
+		free(h->path);
+		h->path = NULL;
+	}
+
+	if (wp.history_len == HISTORY_SIZE) {
+		free(wp.history[wp.history_start].path);
+		wp.history[wp.history_start].path = NULL;
+		wp.history_start = (wp.history_start + 1) % HISTORY_SIZE;
+		wp.history_len--;
+	}
+
+	h = &wp.history[(wp.history_start + wp.history_len) % HISTORY_SIZE];
+	h->path = copy;
+	h->scale_mode = wp.scale_mode;
+	wp.history_pos = wp.history_len++;
+}
+
+static HistoryEntry *history_at(int pos) {
+	if (pos < 0 || pos >= wp.history_len)
+		return NULL;
+	return &wp.history[(wp.history_start + pos) % HISTORY_SIZE];
+}
+
+static void history_clear(void) {
+	for (int i = 0; i < wp.history_len; i++) {
+		free(history_at(i)->path);
+		history_at(i)->path = NULL;
+	}
+	wp.history_start = wp.history_len = wp.history_pos = 0;
+}
+
+/* Keep a streamed frame, and show it if its output has been waiting */
+static void finish_frame_job(WallpaperJob *job) {
+	Animation *anim = job->anim;
+	JobTarget *t = &job->targets[0];
+	WallpaperOutput *o;
+
+	anim->decoding = -1;
+	if (!t->data && job->frame > 0) {
+		/* Damaged from here on, play the frames before */
+		anim->count = job->frame;
+	} else if (!t->data) {
+		/* Not even the first frame anymore: stay on the one shown */
+		gif_close(anim->stream);
+		anim->stream = NULL;
+	} else if (anim->refs > 1) {
+		anim->frames[job->frame] = create_buffer(t->data, anim->width, anim->height);
+		t->data = NULL;
+	}
+
+	wl_list_for_each(o, &wp.outputs, link) {
+		if (o->anim != anim || !anim->waiting || !advance_animation(o))
+			continue;
+		clock_gettime(CLOCK_MONOTONIC, &o->anim_next);
+		add_ms(&o->anim_next, anim->delays[o->anim_pos]);
+		arm_animation_timer();
+	}
+	free_job(job);
+}
+
+/* Show the results of a finished job on the outputs still waiting for it,
+ * or stage them if the job is a prefetch */
+static void finish_job(WallpaperJob *job) {
+	WallpaperOutput *o;
+	WallpaperBuffer *buffer;
+	Animation *anim, *source_anim = NULL;
+	int stage = 0, tiled;
+	int i;
+
+	if (job->anim) {
+		finish_frame_job(job);
+		return;
+	}
+
+	if (job->prefetch) {
+		/* Dropped while in flight */
+		if (job->targets[0].serial != wp.prefetch_serial) {
+			free_job(job);
+			return;
+		}
+		stage = 1;
+	}
+
+	for (i = 0; i < job->ntargets; i++) {
+		JobTarget *t = &job->targets[i];
+
+		/* Output gone, resized, or superseded by a newer request */
+		o = find_output_id(t->output_id);
+		if (!o || (!job->prefetch && t->serial != o->serial)
+				|| t->width != o->buf_width || t->height != o->buf_height)
+			continue;
+
+		if (t->frames || t->source_frames || t->stream) {
+			/* Animations are not staged, taking the prefetch loads it again */
+			if (stage) {
+				drop_staged(o);
+				continue;
+			}
+			if (t->frames) {
+				anim = animation_create(t->frames, job->nframes, job->delays,
+						t->width, t->height, 1, job->scale_mode, NULL);
+			} else if (t->stream) {
+				tiled = job->scale_mode == SCALE_TILE;
+				anim = !t->data ? NULL : animation_create(&t->data, job->nframes,
+						job->delays, tiled ? t->width : job->frame_width,
+						tiled ? t->height : job->frame_height, tiled,
+						job->scale_mode, t->stream);
+				if (anim)
+					t->stream = NULL;
+			} else {
+				if (!source_anim)
+					source_anim = animation_create(job->frames, job->nframes,
+							job->delays, job->frame_width, job->frame_height,
+							0, job->scale_mode, NULL);
+				anim = source_anim;
+				if (anim)
+					anim->refs++;
+			}
+			if (anim) {
+				start_animation(o, anim);
+				animation_unref(anim);
+			}
+			continue;
+		}
+
+		if (!t->data) {
+			if (stage) {
+				drop_staged(o);
+				continue;
+			}
+			fprintf(stderr, "wallpaper: failed to load %s\n", job->path);
+			if (!o->buffer)
+				load_gradient_output(o);
+			continue;
+		}
+
+		buffer = create_target_buffer(t);
+		if (!buffer)
+			continue;
+		if (stage)
+			stage_output_buffer(o, buffer);
+		else
+			show_output_buffer(o, buffer);
+		cache_put(job->path, job->scale_mode, job->filter, buffer);
+	}
+
+	/* Keep results nobody waits for anymore, going back is likely */
+	for (i = 0; i < job->ntargets; i++) {
+		JobTarget *t = &job->targets[i];
+
+		if (t->data && !t->stream && (buffer = create_target_buffer(t)))
+			cache_put(job->path, job->scale_mode, job->filter, buffer);
+	}
+
+	if (source_anim)
+		animation_unref(source_anim);
+	free_job(job);
+	schedule_prefetch();
+}
+
+static void *worker_main(void *arg) {
+	WallpaperJob *job;
+	uint64_t one = 1;
+
+	(void)arg;
+
+	for (;;) {
+		pthread_mutex_lock(&wp.job_lock);
+		while (wl_list_empty(&wp.pending) && !wp.worker_quit)
+			pthread_cond_wait(&wp.job_cond, &wp.job_lock);
+		if (wp.worker_quit) {
+			pthread_mutex_unlock(&wp.job_lock);
+			break;
+		}
+		job = wl_container_of(wp.pending.next, job, link);
+		wl_list_remove(&job->link);
+		pthread_mutex_unlock(&wp.job_lock);
+
+		/* The first job sizes the disk cache, later ones expire old
+		 * entries every DISK_CACHE_SCAN_S */
+		if (wp.disk_cache_dir[0] != '\0'
+				&& time(NULL) - wp.disk_cache_scanned >= DISK_CACHE_SCAN_S)
+			disk_cache_trim();
+
+		run_job(job);
+
+		pthread_mutex_lock(&wp.job_lock);
+		wl_list_insert(wp.done.prev, &job->link);
+		pthread_mutex_unlock(&wp.job_lock);
+
+		if (write(wp.job_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			fprintf(stderr, "wallpaper: failed to signal job completion\n");
+	}
+
+	return NULL;
+}
+
+/* Event loop side of the worker: pick up finished jobs and show them */
+static int job_done_callback(int fd, uint32_t mask, void *data) {
+	struct wl_list done;
+	WallpaperJob *job, *tmp;
+	uint64_t count;
+
+	(void)mask;
+	(void)data;
+
+	if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		return 0;
+
+	wl_list_init(&done);
+	pthread_mutex_lock(&wp.job_lock);
+	wl_list_insert_list(&done, &wp.done);
+	wl_list_init(&wp.done);
+	pthread_mutex_unlock(&wp.job_lock);
+
+	wl_list_for_each_safe(job, tmp, &done, link) {
+		wl_list_remove(&job->link);
+		finish_job(job);
+	}
+	return 0;
+}
+
+static void start_worker(void) {
+	if (wp.worker_running || !wp.event_loop)
+		return;
+
+	wp.job_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (wp.job_fd < 0) {
+		fprintf(stderr, "wallpaper: eventfd failed, decoding synchronously\n");
+		return;
+	}
+
+	wp.job_source = wl_event_loop_add_fd(wp.event_loop, wp.job_fd,
+			WL_EVENT_READABLE, job_done_callback, NULL);
+	if (!wp.job_source) {
+		close(wp.job_fd);
+		wp.job_fd = -1;
+		return;
+	}
+
+	pthread_mutex_init(&wp.job_lock, NULL);
+	pthread_cond_init(&wp.job_cond, NULL);
+	wp.worker_quit = 0;
+
+	if (pthread_create(&wp.worker, NULL, worker_main, NULL) != 0) {
+		fprintf(stderr, "wallpaper: failed to start worker, decoding synchronously\n");
+		pthread_cond_destroy(&wp.job_cond);
+		pthread_mutex_destroy(&wp.job_lock);
+		wl_event_source_remove(wp.job_source);
+		wp.job_source = NULL;
+		close(wp.job_fd);
+		wp.job_fd = -1;
+		return;
+	}
+
+	wp.worker_running = 1;
+}
+
+static void free_job_list(struct wl_list *list) {
+	WallpaperJob *job, *tmp;
+
+	wl_list_for_each_safe(job, tmp, list, link) {
+		wl_list_remove(&job->link);
+		free_job(job);
+	}
+}
+
+/* Free the visible (prefetch == 0) or prefetch jobs still queued.
+ * Frames of streamed animations are left to finish, whose output may
+ * still wait for them. */
+static void free_queued_jobs(int prefetch) {
+	WallpaperJob *job, *tmp;
+
+	pthread_mutex_lock(&wp.job_lock);
+	wl_list_for_each_safe(job, tmp, &wp.pending, link) {
+		if (job->prefetch != prefetch || job->anim)
+			continue;
+		wl_list_remove(&job->link);
+		free_job(job);
+	}
+	pthread_mutex_unlock(&wp.job_lock);
+}
+
+/* Forget the next image; a prefetch still in flight becomes stale */
+static void drop_prefetch(void) {
+	WallpaperOutput *o;
+
+	wp.prefetch_serial = ++wp.job_serial;
+	wp.prefetch_job = NULL;
+	wp.next_file[0] = '\0';
+
+	wl_list_for_each(o, &wp.outputs, link)
+		drop_staged(o);
+
+	if (wp.worker_running)
+		free_queued_jobs(1);
+}
+
+static void stop_worker(void) {
+	if (!wp.worker_running)
+		return;
+
+	pthread_mutex_lock(&wp.job_lock);
+	wp.worker_quit = 1;
+	pthread_cond_signal(&wp.job_cond);
+	pthread_mutex_unlock(&wp.job_lock);
+	pthread_join(wp.worker, NULL);
+
+	free_job_list(&wp.pending);
+	free_job_list(&wp.done);
+
+	pthread_cond_destroy(&wp.job_cond);
+	pthread_mutex_destroy(&wp.job_lock);
+	wl_event_source_remove(wp.job_source);
+	wp.job_source = NULL;
+	close(wp.job_fd);
+	wp.job_fd = -1;
+	wp.worker_running = 0;
+}
+
+/* Drop queued jobs and make in-flight results stale.
+ * The prefetch is kept. */
+static void cancel_image_job(void) {
+	WallpaperOutput *o;
+
+	wl_list_for_each(o, &wp.outputs, link)
+		o->serial = ++wp.job_serial;
+
+	if (wp.worker_running)
+		free_queued_jobs(0);
+}
+
+/* Hand a job to the worker, or run it right away without one.
+ * Prefetch jobs run after every other job. */
+static void queue_job(WallpaperJob *job) {
+	WallpaperJob *pos;
+
+	if (!wp.worker_running) {
+		run_job(job);
+		finish_job(job);
+		return;
+	}
+
+	pthread_mutex_lock(&wp.job_lock);
+	if (job->prefetch) {
+		wl_list_insert(wp.pending.prev, &job->link);
+	} else {
+		wl_list_for_each(pos, &wp.pending, link)
+			if (pos->prefetch)
+				break;
+		wl_list_insert(pos->link.prev, &job->link);
+	}
+	pthread_cond_signal(&wp.job_cond);
+	pthread_mutex_unlock(&wp.job_lock);
+}
+
+/* Queue path for one output, or for every output if only is NULL.
+ * Outputs with a cached result are served right away.
+ * Prefetch jobs run after every visible job and stage their result. */
+static void submit_job(const char *path, WallpaperOutput *only, int prefetch) {
+	WallpaperJob *job;
+	WallpaperOutput *o;
+	WallpaperBuffer *cached;
+	int n = wl_list_length(&wp.outputs);
+
+	if (n == 0)
+		return;
+
+	job = calloc(1, sizeof(*job) + n * sizeof(JobTarget));
+	if (!job)
+		return;
+
+	strncpy(job->path, path, MAX_PATH - 1);
+	job->scale_mode = wp.scale_mode;
+	job->filter = wp.filter;
+	job->scene_scale = wp.scene_scaling && job->scale_mode != SCALE_TILE;
+	job->prefetch = prefetch;
+	if (prefetch)
+		wp.prefetch_serial = ++wp.job_serial;
+	wl_list_for_each(o, &wp.outputs, link) {
+		JobTarget *t;
+
+		if ((only && o != only) || o->buf_width <= 0 || o->buf_height <= 0)
+			continue;
+
+		cached = cache_get(path, o->buf_width, o->buf_height,
+				job->scale_mode, job->filter);
+		if (cached && prefetch) {
+			stage_output_buffer(o, cached);
+			continue;
+		} else if (cached) {
+			o->serial = ++wp.job_serial; /* supersede jobs in flight */
+			show_output_buffer(o, cached);
+			continue;
+		}
+
+		t = &job->targets[job->ntargets++];
+		t->output_id = o->id;
+		t->serial = prefetch ? wp.prefetch_serial : (o->serial = ++wp.job_serial);
+		t->width = o->buf_width;
+		t->height = o->buf_height;
+	}
+
+	/* A new image for every output replaces whatever is still queued */
+	if (!only && !prefetch && wp.worker_running)
+		free_queued_jobs(0);
+
+	if (job->ntargets == 0) {
+		free(job);
+		schedule_prefetch();
+		return;
+	}
+	if (prefetch)
+		wp.prefetch_job = job;
+	queue_job(job);
+}
+
+static void load_image_file(const char *path) {
+	strncpy(wp.current_file, path, MAX_PATH - 1);
+	submit_job(path, NULL, 0);
+}
+
+/* Pick the next image while idle and decode it in the background */
+static void prefetch_idle_callback(void *data) {
+	char *image;
+
+	wp.prefetch_idle = NULL;
+
+	if (wp.next_file[0] != '\0' || wp.prefetch_job || !wp.worker_running)
+		return;
+#ifdef EXTRAS
+	if (wp.is_shader)
+		return;
+#endif
+	if (wp.current_dir[0] == '\0' || wl_list_empty(&wp.outputs))
+		return;
+
+	image = pick_random_image(wp.current_dir);
+	if (!image)
+		return;
+	strncpy(wp.next_file, image, MAX_PATH - 1);
+	free(image);
+	wp.next_scale_mode = wp.scale_mode;
+
+	submit_job(wp.next_file, NULL, 1);
+}
+
+static void schedule_prefetch(void) {
+	if (wp.prefetch_idle || !wp.event_loop || !wp.worker_running)
+		return;
+	if (wp.next_file[0] != '\0' || wp.prefetch_job)
+		return;
+	wp.prefetch_idle = wl_event_loop_add_idle(wp.event_loop,
+			prefetch_idle_callback, NULL);
+}
+
+/* Whether path names a file directly inside dir */
+static int in_dir(const char *path, const char *dir) {
+	size_t len = strlen(dir);
+
+	return strncmp(path, dir, len) == 0 && path[len] == '/'
+		&& !strchr(path + len + 1, '/');
+}
+
+static JobTarget *find_target(WallpaperJob *job, unsigned int output_id) {
+	for (int i = 0; i < job->ntargets; i++)
+		if (job->targets[i].output_id == output_id)
+			return &job->targets[i];
+	return NULL;
+}
+
+/* Show the next image picked by prefetch, returns 0 if there is none.
+ * Outputs with a staged buffer just swap it in. A prefetch still being
+ * decoded turns into a visible job, so it is not started over. */
+static int take_prefetch(void) {
+	WallpaperOutput *o;
+	WallpaperJob *job;
+	JobTarget *t;
+
+	if (wp.next_file[0] == '\0')
+		return 0;
+
+	/* Picked for a directory or scaling mode that is no longer current */
+	if (wp.next_scale_mode != wp.scale_mode || !in_dir(wp.next_file, wp.current_dir)) {
+		drop_prefetch();
+		return 0;
+	}
+
+	cancel_image_job();
+	strncpy(wp.current_file, wp.next_file, MAX_PATH - 1);
+	wp.next_file[0] = '\0';
+	history_push(wp.current_file);
+
+	/* Only the event loop reads prefetch and serial, the worker
+	 * just fills in data */
+	job = wp.prefetch_job;
+	wp.prefetch_job = NULL;
+	if (job)
+		job->prefetch = 0;
+
+	wl_list_for_each(o, &wp.outputs, link) {
+		if (o->staged && o->staged->out_width == o->buf_width
+				&& o->staged->out_height == o->buf_height) {
+			show_output_buffer(o, o->staged);
+			drop_staged(o);
+			continue;
+		}
+		drop_staged(o);
+
+		if (job && (t = find_target(job, o->id))
+				&& t->width == o->buf_width && t->height == o->buf_height)
+			t->serial = o->serial = ++wp.job_serial;
+		else
+			submit_job(wp.current_file, o, 0);
+	}
+
+	schedule_prefetch();
+	return 1;
+}
+
+/* Opaque XRGB color at projection proj onto the gradient axis */
+static uint32_t gradient_color(double proj, double max_proj) {
+	double t = (proj + max_proj / 2.0) / max_proj;
+	unsigned char r, g, b;
+
+	/* Clamp t to [0, 1] */
+	if (t < 0.0) t = 0.0;
+	if (t > 1.0) t = 1.0;
+
+	/* Interpolate colors */
+	r = (unsigned char)(GRADIENT_COLOR1_R + t * (GRADIENT_COLOR2_R - GRADIENT_COLOR1_R));
+	g = (unsigned char)(GRADIENT_COLOR1_G + t * (GRADIENT_COLOR2_G - GRADIENT_COLOR1_G));
+	b = (unsigned char)(GRADIENT_COLOR1_B + t * (GRADIENT_COLOR2_B - GRADIENT_COLOR1_B));
+	return 0xFF000000u | (uint32_t)r << 16 | (uint32_t)g << 8 | b;
+}
+
+static void load_gradient_output(WallpaperOutput *o) {
+	unsigned char *data;
+	uint32_t *row, color, run;
+	size_t stride;
+	double angle_rad, cos_a, sin_a;
+	double max_proj;
+	int x, y, start;
+
+	if (o->buf_width <= 0 || o->buf_height <= 0)
+		return;
+
+	stride = o->buf_width * 4;
+	data = calloc(1, stride * o->buf_height);
+	if (!data)
+		return;
+
+	/* Convert angle to radians */
+	angle_rad = GRADIENT_ANGLE * M_PI / 180.0;
+	cos_a = cos(angle_rad);
+	sin_a = sin(angle_rad);
+
+	/* Calculate max projection for normalization */
+	max_proj = fabs(o->buf_width * cos_a) + fabs(o->buf_height * sin_a);
+
+	/* Colors change in steps, so write each row as runs of one color */
+	for (y = 0; y < o->buf_height; y++) {
+		row = (uint32_t *)(data + y * stride);
+		run = gradient_color(y * sin_a, max_proj);
+		for (start = 0, x = 1; x < o->buf_width; x++) {
+			/* Project point onto gradient axis */
+			color = gradient_color(x * cos_a + y * sin_a, max_proj);
+			if (color == run)
+				continue;
+			pixel_fill(row + start, run, (size_t)(x - start));
+			start = x;
+			run = color;
+		}
+		pixel_fill(row + start, run, (size_t)(o->buf_width - start));
 	}
 
-	wlr_buffer_init(&buffer->base, &buffer_impl, wp.width, wp.height);
-	buffer->data = data;
-	buffer->format = DRM_FORMAT_ARGB8888;
-	buffer->stride = stride;
+	/* A late image result must not replace the fallback */
+	o->serial = ++wp.job_serial;
+	set_output_data(o, data, o->buf_width, o->buf_height,
+			&(struct wlr_box){ 0, 0, o->buf_width, o->buf_height });
+}
 
-	/* Update scene buffer */
-	if (wp.scene_buffer) {
-		wlr_scene_buffer_set_buffer(wp.scene_buffer, &buffer->base);
-		wlr_scene_buffer_set_dest_size(wp.scene_buffer, wp.width, wp.height);
-	}
+static void load_gradient_fallback(void) {
+	WallpaperOutput *o;
 
-	/* Release old buffer */
-	if (wp.buffer)
-		wlr_buffer_drop(&wp.buffer->base);
-	wp.buffer = buffer;
+	cancel_image_job();
+	wl_list_for_each(o, &wp.outputs, link)
+		load_gradient_output(o);
 }
 
 #ifdef EXTRAS
@@ -592,63 +3005,74 @@ static GLuint compile_shader(GLenum type, const char *source) {
 
 /* Pick a random shader from directory */
 static char *pick_random_shader(const char *dir_path) {
-	DIR *dir;
-	struct dirent *entry;
-	char **shaders = NULL;
-	int count = 0;
-	int capacity = 0;
-	char *result = NULL;
-	char full_path[MAX_PATH];
+	IndexDir *d = index_get_dir(dir_path);
 
-	dir = opendir(dir_path);
-	if (!dir)
-		return NULL;
-
-	while ((entry = readdir(dir)) != NULL) {
-		if (entry->d_name[0] == '.')
-			continue;
+	return d ? pick_from_bag(d->path, &d->shaders) : NULL;
+}
 
-		if (is_shader_file(entry->d_name)) {
-			snprintf(full_path, sizeof(full_path), "%s/%s", dir_path, entry->d_name);
+static void destroy_swapchain(WallpaperOutput *o) {
+	if (o->swapchain) {
+		wlr_swapchain_destroy(o->swapchain);
+		o->swapchain = NULL;
+	}
+}
 
-			/* Skip current shader unless it's the only one */
-			if (strcmp(full_path, wp.current_file) == 0)
-				continue;
+static void drop_shader_pool(WallpaperOutput *o) {
+	size_t i;
 
-			if (count >= capacity) {
-				capacity = capacity ? capacity * 2 : 16;
-				shaders = realloc(shaders, capacity * sizeof(char *));
-			}
-			shaders[count++] = strdup(full_path);
+	for (i = 0; i < LENGTH(o->pool); i++) {
+		if (o->pool[i]) {
+			wlr_buffer_drop(&o->pool[i]->base);
+			o->pool[i] = NULL;
 		}
 	}
-	closedir(dir);
+}
 
-	/* If no other shaders found, fall back to current only if it's in this directory */
-	if (count == 0 && wp.current_file[0] != '\0' && is_shader_file(wp.current_file)) {
-		/* Check if current_file is in dir_path */
-		if (strncmp(wp.current_file, dir_path, strlen(dir_path)) == 0) {
-			return strdup(wp.current_file);
-		}
-	}
+static void shader_buffer_release(struct wl_listener *listener, void *data) {
+	WallpaperBuffer *buffer = wl_container_of(listener, buffer, release);
 
-	if (count > 0) {
-		int idx = rand() % count;
-		result = shaders[idx];
-		shaders[idx] = NULL;
-	}
+	buffer->busy = 0;
+	wl_list_remove(&buffer->release.link);
+}
+
+/* Free buffer of the output's readback ring, like the bar's buffer pool */
+static WallpaperBuffer *shader_pool_get(WallpaperOutput *o, int width, int height) {
+	WallpaperBuffer *buffer = NULL;
+	unsigned char *data;
+	size_t i;
+
+	if (o->pool[0] && (o->pool[0]->base.width != width || o->pool[0]->base.height != height))
+		drop_shader_pool(o);
+
+	for (i = 0; i < LENGTH(o->pool); i++) {
+		if (o->pool[i]) {
+			if (o->pool[i]->busy)
+				continue;
+			buffer = o->pool[i];
+			break;
+		}
 
-	for (int i = 0; i < count; i++) {
-		if (shaders[i])
-			free(shaders[i]);
+		data = malloc((size_t)width * 4 * height);
+		if (!data)
+			return NULL;
+		buffer = create_buffer(data, width, height);
+		if (!buffer)
+			return NULL;
+		o->pool[i] = buffer;
+		break;
 	}
-	free(shaders);
+	if (!buffer)
+		return NULL;
 
-	return result;
+	buffer->busy = 1;
+	buffer->release.notify = shader_buffer_release;
+	wl_signal_add(&buffer->base.events.release, &buffer->release);
+	return buffer;
 }
 
 /* Clean up shader resources */
 static void cleanup_shader(void) {
+	WallpaperOutput *o;
 	struct wlr_egl *egl;
 	EGLDisplay display;
 	EGLContext context;
@@ -674,10 +3098,8 @@ static void cleanup_shader(void) {
 			prev_read = eglGetCurrentSurface(EGL_READ);
 
 			if (eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
-				if (wp.shader_program) {
-					glDeleteProgram(wp.shader_program);
-					wp.shader_program = 0;
-				}
+				/* The program stays in the program cache */
+				wp.shader_program = 0;
 				if (wp.vbo) {
 					glDeleteBuffers(1, &wp.vbo);
 					wp.vbo = 0;
@@ -690,6 +3112,7 @@ static void cleanup_shader(void) {
 					glDeleteTextures(1, &wp.render_texture);
 					wp.render_texture = 0;
 				}
+				wp.render_width = wp.render_height = 0;
 
 				/* Restore context */
 				eglMakeCurrent(display, prev_draw, prev_read, prev_context);
@@ -697,16 +3120,348 @@ static void cleanup_shader(void) {
 		}
 	}
 
+	wl_list_for_each(o, &wp.outputs, link) {
+		destroy_swapchain(o);
+		drop_shader_pool(o);
+	}
+	free(wp.readback);
+	wp.readback = NULL;
+	wp.readback_size = 0;
+
+	wp.shader_program = 0;
 	wp.is_shader = 0;
 	wp.shader_time = 0.0f;
 }
 
+/* Make the renderer's EGL context current, saving the previous one */
+static int gl_begin(GLSaved *saved) {
+	struct wlr_egl *egl;
+
+	if (!wp.renderer || !wlr_renderer_is_gles2(wp.renderer))
+		return 0;
+	egl = wlr_gles2_renderer_get_egl(wp.renderer);
+	if (!egl)
+		return 0;
+	saved->display = wlr_egl_get_display(egl);
+	saved->context = eglGetCurrentContext();
+	saved->draw = eglGetCurrentSurface(EGL_DRAW);
+	saved->read = eglGetCurrentSurface(EGL_READ);
+	return eglMakeCurrent(saved->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+			wlr_egl_get_context(egl));
+}
+
+static void gl_end(const GLSaved *saved) {
+	eglMakeCurrent(saved->display, saved->draw, saved->read, saved->context);
+}
+
+/* Look up GL_OES_get_program_binary once a context is current */
+static void check_program_binary(void) {
+	const char *exts;
+	GLint formats = 0;
+
+	if (wp.program_binary_checked)
+		return;
+	wp.program_binary_checked = 1;
+	exts = (const char *)glGetString(GL_EXTENSIONS);
+	if (!exts || !strstr(exts, "GL_OES_get_program_binary"))
+		return;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS_OES, &formats);
+	if (formats <= 0)
+		return;
+	wp.get_program_binary = (PFNGLGETPROGRAMBINARYOESPROC)
+		eglGetProcAddress("glGetProgramBinaryOES");
+	wp.program_binary = (PFNGLPROGRAMBINARYOESPROC)
+		eglGetProcAddress("glProgramBinaryOES");
+	if (!wp.get_program_binary || !wp.program_binary)
+		wp.get_program_binary = NULL, wp.program_binary = NULL;
+}
+
+/* Binaries only load on the driver that made them, so it is part of the key */
+static uint64_t program_hash(const char *frag_source) {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	const char *s;
+
+	hash = fnv1a(hash, default_vertex_shader, strlen(default_vertex_shader) + 1);
+	hash = fnv1a(hash, frag_source, strlen(frag_source) + 1);
+	if ((s = (const char *)glGetString(GL_RENDERER)))
+		hash = fnv1a(hash, s, strlen(s) + 1);
+	if ((s = (const char *)glGetString(GL_VERSION)))
+		hash = fnv1a(hash, s, strlen(s) + 1);
+	return hash;
+}
+
+static GLuint link_program(const char *frag_source) {
+	GLuint vert_shader, frag_shader, program;
+	GLint status;
+	GLchar log[512];
+
+	vert_shader = compile_shader(GL_VERTEX_SHADER, default_vertex_shader);
+	if (!vert_shader)
+		return 0;
+	frag_shader = compile_shader(GL_FRAGMENT_SHADER, frag_source);
+	if (!frag_shader) {
+		glDeleteShader(vert_shader);
+		return 0;
+	}
+
+	program = glCreateProgram();
+	glAttachShader(program, vert_shader);
+	glAttachShader(program, frag_shader);
+	glLinkProgram(program);
+
+	glDeleteShader(vert_shader);
+	glDeleteShader(frag_shader);
+
+	glGetProgramiv(program, GL_LINK_STATUS, &status);
+	if (!status) {
+		glGetProgramInfoLog(program, sizeof(log), NULL, log);
+		fprintf(stderr, "wallpaper: shader link error: %s\n", log);
+		glDeleteProgram(program);
+		return 0;
+	}
+	return program;
+}
+
+/* Load a program saved by save_program_binary, 0 if missing or stale */
+static GLuint load_program_binary(uint64_t hash) {
+	char file[MAX_PATH];
+	ProgramCacheHeader h;
+	void *data;
+	GLuint program = 0;
+	GLint status = 0;
+	FILE *f;
+
+	if (!wp.program_binary || wp.program_cache_dir[0] == '\0')
+		return 0;
+	snprintf(file, sizeof(file), "%s/%016llx.bin", wp.program_cache_dir,
+			(unsigned long long)hash);
+	f = fopen(file, "rb");
+	if (!f)
+		return 0;
+	if (fread(&h, sizeof(h), 1, f) != 1
+			|| memcmp(h.magic, PROGRAM_CACHE_MAGIC, sizeof(h.magic)) != 0
+			|| h.length == 0 || h.length > (64u << 20)
+			|| !(data = malloc(h.length))) {
+		fclose(f);
+		return 0;
+	}
+	if (fread(data, 1, h.length, f) == h.length) {
+		futimens(fileno(f), NULL); /* age counts from the last use */
+		program = glCreateProgram();
+		wp.program_binary(program, h.format, data, (GLint)h.length);
+		glGetProgramiv(program, GL_LINK_STATUS, &status);
+	}
+	free(data);
+	fclose(f);
+
+	if (!status) {
+		/* Driver changed or file is damaged; it is rewritten after compiling */
+		if (program)
+			glDeleteProgram(program);
+		unlink(file);
+		return 0;
+	}
+	return program;
+}
+
+static void save_program_binary(uint64_t hash, GLuint program) {
+	char file[MAX_PATH], tmp[MAX_PATH + 16];
+	ProgramCacheHeader h;
+	GLint length = 0;
+	GLsizei written = 0;
+	GLenum format = 0;
+	void *data;
+	FILE *f;
+	int ok;
+
+	if (!wp.get_program_binary || wp.program_cache_dir[0] == '\0')
+		return;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH_OES, &length);
+	if (length <= 0 || !(data = malloc((size_t)length)))
+		return;
+	wp.get_program_binary(program, length, &written, &format, data);
+	if (written <= 0) {
+		free(data);
+		return;
+	}
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, PROGRAM_CACHE_MAGIC, sizeof(h.magic));
+	h.format = format;
+	h.length = (uint32_t)written;
+
+	snprintf(file, sizeof(file), "%s/%016llx.bin", wp.program_cache_dir,
+			(unsigned long long)hash);
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", file, (int)getpid());
+	f = fopen(tmp, "wb");
+	if (!f) {
+		free(data);
+		return;
+	}
+	ok = fwrite(&h, sizeof(h), 1, f) == 1
+		&& fwrite(data, 1, (size_t)written, f) == (size_t)written;
+	ok = fclose(f) == 0 && ok;
+	if (!ok || rename(tmp, file) != 0)
+		unlink(tmp);
+	free(data);
+}
+
+static void program_free(ShaderProgram *p) {
+	wl_list_remove(&p->link);
+	glDeleteProgram(p->program);
+	wp.nprograms--;
+	free(p);
+}
+
+/* Linked program for a fragment shader: from memory, from its saved binary,
+ * or compiled. The program stays owned by the cache. Needs the GL context. */
+static ShaderProgram *program_get(const char *frag_source) {
+	ShaderProgram *p, *tmp, *added;
+	uint64_t hash;
+	GLuint program;
+	int from_binary = 1;
+
+	check_program_binary();
+	hash = program_hash(frag_source);
+	wl_list_for_each(p, &wp.programs, link) {
+		if (p->hash == hash) {
+			wl_list_remove(&p->link);
+			wl_list_insert(&wp.programs, &p->link);
+			return p;
+		}
+	}
+
+	program = load_program_binary(hash);
+	if (!program) {
+		from_binary = 0;
+		program = link_program(frag_source);
+		if (!program)
+			return NULL;
+	}
+
+	p = calloc(1, sizeof(*p));
+	if (!p) {
+		glDeleteProgram(program);
+		return NULL;
+	}
+	p->hash = hash;
+	p->program = program;
+	p->u_time = glGetUniformLocation(program, "time");
+	p->u_resolution = glGetUniformLocation(program, "resolution");
+	wl_list_insert(&wp.programs, &p->link);
+	wp.nprograms++;
+	if (!from_binary)
+		save_program_binary(hash, program);
+
+	/* Evict least recently used, never the program being drawn */
+	added = p;
+	wl_list_for_each_reverse_safe(p, tmp, &wp.programs, link) {
+		if (wp.nprograms <= PROGRAM_CACHE_SIZE)
+			break;
+		if (p != added && p->program != wp.shader_program)
+			program_free(p);
+	}
+	return added;
+}
+
+static void program_cache_clear(void) {
+	GLSaved saved;
+	ShaderProgram *p, *tmp;
+
+	if (wl_list_empty(&wp.programs))
+		return;
+	if (!gl_begin(&saved)) {
+		/* Context is gone and the programs with it */
+		wl_list_for_each_safe(p, tmp, &wp.programs, link) {
+			wl_list_remove(&p->link);
+			free(p);
+		}
+		wp.nprograms = 0;
+		return;
+	}
+	wl_list_for_each_safe(p, tmp, &wp.programs, link)
+		program_free(p);
+	gl_end(&saved);
+}
+
+static void warmup_clear(void) {
+	int i;
+
+	for (i = 0; i < wp.warmup_count; i++)
+		free(wp.warmup[i]);
+	free(wp.warmup);
+	wp.warmup = NULL;
+	wp.warmup_count = wp.warmup_pos = 0;
+	if (wp.warmup_timer)
+		wl_event_source_timer_update(wp.warmup_timer, 0);
+}
+
+/* Compile the next queued shader that is not linked yet, one per call so
+ * input and frames are handled in between */
+static int warmup_callback(void *data) {
+	GLSaved saved;
+	char *source;
+	int compiled = 0;
+
+	while (!compiled && wp.warmup_pos < wp.warmup_count) {
+		source = read_shader_source(wp.warmup[wp.warmup_pos++]);
+		if (!source)
+			continue;
+		if (gl_begin(&saved)) {
+			/* Don't push out programs just to warm others */
+			if (wp.nprograms < PROGRAM_CACHE_SIZE) {
+				compiled = program_get(source) != NULL;
+			} else {
+				wp.warmup_pos = wp.warmup_count;
+			}
+			gl_end(&saved);
+		}
+		free(source);
+	}
+
+	if (wp.warmup_pos < wp.warmup_count)
+		wl_event_source_timer_update(wp.warmup_timer, SHADER_WARMUP_MS);
+	else
+		warmup_clear();
+	return 0;
+}
+
+/* Queue the current directory's other shaders for compiling while idle, so
+ * switching to them doesn't stall on the compiler */
+static void schedule_shader_warmup(void) {
+	IndexDir *d = index_get_dir(wp.current_dir);
+	char path[MAX_PATH];
+	int i;
+
+	warmup_clear();
+	if (!d || d->shaders.count < 2 || !wp.event_loop)
+		return;
+	if (!wp.warmup_timer) {
+		wp.warmup_timer = wl_event_loop_add_timer(wp.event_loop,
+				warmup_callback, NULL);
+		if (!wp.warmup_timer)
+			return;
+	}
+	wp.warmup = calloc((size_t)d->shaders.count, sizeof(*wp.warmup));
+	if (!wp.warmup)
+		return;
+	for (i = 0; i < d->shaders.count; i++) {
+		snprintf(path, sizeof(path), "%s/%s", d->path,
+				(const char *)d->shaders.items[i]);
+		if (strcmp(path, wp.current_file) == 0)
+			continue;
+		if (!(wp.warmup[wp.warmup_count] = strdup(path)))
+			break;
+		wp.warmup_count++;
+	}
+	if (wp.warmup_count > 0)
+		wl_event_source_timer_update(wp.warmup_timer, SHADER_WARMUP_MS);
+}
+
 /* Load and compile a shader file */
 static int load_shader_file(const char *path) {
 	char *frag_source;
-	GLuint vert_shader, frag_shader;
-	GLint status;
-	GLchar log[512];
+	ShaderProgram *prog;
 	struct wlr_egl *egl;
 	EGLDisplay display;
 	EGLContext context;
@@ -735,99 +3490,314 @@ static int load_shader_file(const char *path) {
 		return 0;
 	}
 
-	display = wlr_egl_get_display(egl);
-	context = wlr_egl_get_context(egl);
+	display = wlr_egl_get_display(egl);
+	context = wlr_egl_get_context(egl);
+
+	/* Save current EGL state */
+	prev_context = eglGetCurrentContext();
+	prev_draw = eglGetCurrentSurface(EGL_DRAW);
+	prev_read = eglGetCurrentSurface(EGL_READ);
+
+	/* Make EGL context current */
+	if (!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+		fprintf(stderr, "wallpaper: failed to make EGL context current\n");
+		return 0;
+	}
+
+	/* Read fragment shader source */
+	frag_source = read_shader_source(path);
+	if (!frag_source) {
+		fprintf(stderr, "wallpaper: failed to read shader %s\n", path);
+		eglMakeCurrent(display, prev_draw, prev_read, prev_context);
+		return 0;
+	}
+
+	/* Usually linked already, by an earlier visit or the warm-up */
+	prog = program_get(frag_source);
+	free(frag_source);
+	if (!prog) {
+		eglMakeCurrent(display, prev_draw, prev_read, prev_context);
+		return 0;
+	}
+	wp.shader_program = prog->program;
+	wp.u_time = prog->u_time;
+	wp.u_resolution = prog->u_resolution;
+
+	/* Create VBO for fullscreen quad */
+	glGenBuffers(1, &wp.vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, wp.vbo);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0); /* Unbind - wlroots expects clean state */
+
+	/* Create FBO and texture for offscreen rendering */
+	glGenFramebuffers(1, &wp.fbo);
+	glGenTextures(1, &wp.render_texture);
+
+	wp.is_shader = 1;
+	wp.shader_time = 0.0f;
+	clock_gettime(CLOCK_MONOTONIC, &wp.shader_start);
+
+	/* Each shader costs differently; start from the best quality */
+	wp.shader_scale = wp.shader_scale_max;
+	wp.shader_frame_ms = SHADER_FRAME_MS;
+	wp.shader_frames = 0;
+	wp.shader_cost = 0.0f;
+	strncpy(wp.current_file, path, MAX_PATH - 1);
+
+	/* Restore previous EGL state */
+	if (!eglMakeCurrent(display, prev_draw, prev_read, prev_context)) {
+		fprintf(stderr, "wallpaper: failed to restore EGL context\n");
+	}
+
+	return 1;
+}
+
+/* Draw the shader as a fullscreen quad into the bound framebuffer */
+static void draw_shader(int width, int height) {
+	GLint pos_attrib;
+
+	glViewport(0, 0, width, height);
+
+	/* Clear FBO before drawing */
+	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+	glClear(GL_COLOR_BUFFER_BIT);
+
+	/* Run shader */
+	glUseProgram(wp.shader_program);
+
+	if (wp.u_time >= 0)
+		glUniform1f(wp.u_time, wp.shader_time);
+	if (wp.u_resolution >= 0)
+		glUniform2f(wp.u_resolution, (float)width, (float)height);
+
+	glBindBuffer(GL_ARRAY_BUFFER, wp.vbo);
+	pos_attrib = glGetAttribLocation(wp.shader_program, "position");
+	glEnableVertexAttribArray(pos_attrib);
+	glVertexAttribPointer(pos_attrib, 2, GL_FLOAT, GL_FALSE, 0, 0);
+
+	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+
+	glDisableVertexAttribArray(pos_attrib);
+	glBindBuffer(GL_ARRAY_BUFFER, 0); /* Clean up state */
+	glUseProgram(0);
+}
+
+/* Render straight into a buffer from the compositor's allocator that the
+ * scene samples as is. Returns 0 if this path is unavailable. */
+static int render_shader_gpu(WallpaperOutput *o, int width, int height) {
+	struct wlr_buffer *buffer;
+	GLuint fbo;
+
+	if (!wp.allocator || wp.gpu_failed)
+		return 0;
+
+	if (o->swapchain && (o->swapchain->width != width || o->swapchain->height != height))
+		destroy_swapchain(o);
+	if (!o->swapchain) {
+		o->swapchain = wlr_swapchain_create(wp.allocator, width, height, &wp.shader_format);
+		if (!o->swapchain) {
+			fprintf(stderr, "wallpaper: cannot allocate shader buffers, reading frames back\n");
+			wp.gpu_failed = 1;
+			return 0;
+		}
+	}
+
+	/* Every slot still in use by the scene: try again next frame */
+	buffer = wlr_swapchain_acquire(o->swapchain);
+	if (!buffer) {
+		o->shader_due = 1;
+		return 1;
+	}
+
+	fbo = wlr_gles2_renderer_get_buffer_fbo(wp.renderer, buffer);
+	if (!fbo) {
+		fprintf(stderr, "wallpaper: cannot render to shader buffers, reading frames back\n");
+		wlr_buffer_unlock(buffer);
+		destroy_swapchain(o);
+		wp.gpu_failed = 1;
+		return 0;
+	}
+
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	draw_shader(width, height);
+	glFlush();
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	/* Stretched over the whole output, clearing any source box, offset or
+	 * opaque region the previous wallpaper left. GL puts row 0 at the
+	 * bottom, the scene reads it as the top. */
+	wlr_scene_buffer_set_buffer(o->scene_buffer, buffer);
+	place_buffer(o, o->scene_buffer, NULL);
+	wlr_scene_buffer_set_transform(o->scene_buffer, WL_OUTPUT_TRANSFORM_FLIPPED_180);
+	wlr_buffer_unlock(buffer); /* the scene keeps it until the next frame */
+
+	if (o->buffer) {
+		wlr_buffer_unlock(&o->buffer->base);
+		o->buffer = NULL;
+	}
+	return 1;
+}
+
+/* Render the current shader frame into one output's buffer.
+ * The EGL context must already be current. */
+static void render_shader_output(WallpaperOutput *o) {
+	WallpaperBuffer *buffer;
+	unsigned char *data, *final_data;
+	size_t stride, size;
+	int width, height;
+
+	if (o->buf_width <= 0 || o->buf_height <= 0)
+		return;
+	end_transition(o);
+	stop_animation(o);
+
+	/* The scene scales it up to the output */
+	width = (int)((float)o->buf_width * wp.shader_scale + 0.5f);
+	height = (int)((float)o->buf_height * wp.shader_scale + 0.5f);
+	if (width < 1)
+		width = 1;
+	if (height < 1)
+		height = 1;
+
+	if (render_shader_gpu(o, width, height))
+		return;
 
-	/* Save current EGL state */
-	prev_context = eglGetCurrentContext();
-	prev_draw = eglGetCurrentSurface(EGL_DRAW);
-	prev_read = eglGetCurrentSurface(EGL_READ);
+	/* Setup offscreen framebuffer */
+	glBindFramebuffer(GL_FRAMEBUFFER, wp.fbo);
 
-	/* Make EGL context current */
-	if (!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
-		fprintf(stderr, "wallpaper: failed to make EGL context current\n");
-		return 0;
+	glBindTexture(GL_TEXTURE_2D, wp.render_texture);
+	if (wp.render_width != width || wp.render_height != height) {
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		wp.render_width = width;
+		wp.render_height = height;
 	}
 
-	/* Read fragment shader source */
-	frag_source = read_shader_source(path);
-	if (!frag_source) {
-		fprintf(stderr, "wallpaper: failed to read shader %s\n", path);
-		return 0;
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, wp.render_texture, 0);
+
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		return;
 	}
 
-	/* Compile vertex shader */
-	vert_shader = compile_shader(GL_VERTEX_SHADER, default_vertex_shader);
-	if (!vert_shader) {
-		free(frag_source);
-		return 0;
+	draw_shader(width, height);
+
+	/* Read pixels into CPU buffer, both kept across frames */
+	stride = (size_t)width * 4;
+	size = stride * height;
+	if (wp.readback_size < size) {
+		data = realloc(wp.readback, size);
+		if (!data) {
+			glBindFramebuffer(GL_FRAMEBUFFER, 0);
+			return;
+		}
+		wp.readback = data;
+		wp.readback_size = size;
 	}
+	data = wp.readback;
 
-	/* Compile fragment shader */
-	frag_shader = compile_shader(GL_FRAGMENT_SHADER, frag_source);
-	free(frag_source);
-	if (!frag_shader) {
-		glDeleteShader(vert_shader);
-		return 0;
+	/* Both ring buffers still shown: try again next frame */
+	buffer = shader_pool_get(o, width, height);
+	if (!buffer) {
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		o->shader_due = 1;
+		return;
 	}
+	final_data = buffer->data;
 
-	/* Link program */
-	wp.shader_program = glCreateProgram();
-	glAttachShader(wp.shader_program, vert_shader);
-	glAttachShader(wp.shader_program, frag_shader);
-	glLinkProgram(wp.shader_program);
+	glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, data);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
-	glDeleteShader(vert_shader);
-	glDeleteShader(frag_shader);
+	/* Convert RGBA to BGRA and flip vertically */
+	pixel_swizzle_flip(final_data, stride, data, stride, width, height);
 
-	glGetProgramiv(wp.shader_program, GL_LINK_STATUS, &status);
-	if (!status) {
-		glGetProgramInfoLog(wp.shader_program, sizeof(log), NULL, log);
-		fprintf(stderr, "wallpaper: shader link error: %s\n", log);
-		glDeleteProgram(wp.shader_program);
-		wp.shader_program = 0;
-		return 0;
-	}
+	show_output_buffer(o, buffer); /* the ring keeps the producer reference */
+}
 
-	/* Get uniform locations */
-	wp.u_time = glGetUniformLocation(wp.shader_program, "time");
-	wp.u_resolution = glGetUniformLocation(wp.shader_program, "resolution");
+/* Arm the shader timer for the next frame, at most every shader_frame_ms */
+static void schedule_shader_frame(void) {
+	long delay;
 
-	/* Create VBO for fullscreen quad */
-	glGenBuffers(1, &wp.vbo);
-	glBindBuffer(GL_ARRAY_BUFFER, wp.vbo);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
-	glBindBuffer(GL_ARRAY_BUFFER, 0); /* Unbind - wlroots expects clean state */
+	if (!wp.shader_timer || wp.shader_timer_armed || !wp.is_shader)
+		return;
 
-	/* Create FBO and texture for offscreen rendering */
-	glGenFramebuffers(1, &wp.fbo);
-	glGenTextures(1, &wp.render_texture);
+	delay = wp.shader_frame_ms - ms_since(&wp.shader_last_frame);
+	if (delay < 1)
+		delay = 1;
+	if (delay > wp.shader_frame_ms)
+		delay = wp.shader_frame_ms;
+	wl_event_source_timer_update(wp.shader_timer, (int)delay);
+	wp.shader_timer_armed = 1;
+}
 
-	wp.is_shader = 1;
-	wp.shader_time = 0.0f;
-	strncpy(wp.current_file, path, MAX_PATH - 1);
+/* Render the next frame on output o as soon as pacing allows */
+static void request_shader_frame(WallpaperOutput *o) {
+	o->shader_due = 1;
+	schedule_shader_frame();
+}
 
-	/* Restore previous EGL state */
-	if (!eglMakeCurrent(display, prev_draw, prev_read, prev_context)) {
-		fprintf(stderr, "wallpaper: failed to restore EGL context\n");
+/* The scene only signals frame_done for buffers with visible area on an
+ * enabled output. A covered, DPMS-off or locked wallpaper therefore stops
+ * requesting frames and the animation pauses until it is seen again. */
+static void handle_frame_done(struct wl_listener *listener, void *data) {
+	WallpaperOutput *o = wl_container_of(listener, o, frame_done);
+
+	if (wp.is_shader)
+		request_shader_frame(o);
+}
+
+/* Fit measured frames into the budget. Cost follows the pixel count, so
+ * resolution goes down first and frame rate only at the lowest scale. */
+static void govern_shader(float cost) {
+	float budget = (float)wp.shader_budget_ms;
+	float scale = wp.shader_scale;
+
+	wp.shader_cost = wp.shader_cost > 0.0f ? 0.7f * wp.shader_cost + 0.3f * cost : cost;
+	if (wp.shader_budget_ms <= 0)
+		return;
+
+	if (wp.shader_cost > budget) {
+		if (scale > SHADER_SCALE_MIN)
+			scale *= sqrtf(budget / wp.shader_cost);
+		else
+			wp.shader_frame_ms = (int)((float)SHADER_FRAME_MS * wp.shader_cost / budget);
+	} else if (wp.shader_cost < budget / 2.0f) {
+		if (wp.shader_frame_ms > SHADER_FRAME_MS)
+			wp.shader_frame_ms = wp.shader_frame_ms * 3 / 4;
+		else if (scale < wp.shader_scale_max)
+			scale *= 1.25f;
 	}
 
-	return 1;
+	/* Steps of 1/16 keep buffers from being reallocated for small changes */
+	scale = roundf(scale * 16.0f) / 16.0f;
+	if (scale < SHADER_SCALE_MIN)
+		scale = SHADER_SCALE_MIN;
+	if (scale > wp.shader_scale_max)
+		scale = wp.shader_scale_max;
+	if (wp.shader_frame_ms < SHADER_FRAME_MS)
+		wp.shader_frame_ms = SHADER_FRAME_MS;
+	if (wp.shader_frame_ms > SHADER_FRAME_MS_MAX)
+		wp.shader_frame_ms = SHADER_FRAME_MS_MAX;
+
+	if (scale != wp.shader_scale) {
+		wp.shader_scale = scale;
+		wp.shader_cost = 0.0f; /* measure the new size afresh */
+	}
 }
 
-/* Render one frame of the shader */
+/* Render one frame of the shader on every output waiting for one */
 static void render_shader_frame(void) {
+	struct timespec start;
+	int measure;
 	struct wlr_egl *egl;
 	EGLDisplay display;
 	EGLContext context;
 	EGLContext prev_context;
 	EGLSurface prev_draw, prev_read;
-	WallpaperBuffer *buffer;
-	unsigned char *data;
-	size_t stride;
-	GLint pos_attrib;
+	WallpaperOutput *o;
 
-	if (!wp.is_shader || !wp.shader_program || wp.width == 0 || wp.height == 0)
+	if (!wp.is_shader || !wp.shader_program || wl_list_empty(&wp.outputs))
 		return;
 
 	/* Get EGL context */
@@ -846,116 +3816,61 @@ static void render_shader_frame(void) {
 	if (!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context))
 		return;
 
-	/* Setup offscreen framebuffer */
-	glBindFramebuffer(GL_FRAMEBUFFER, wp.fbo);
-
-	glBindTexture(GL_TEXTURE_2D, wp.render_texture);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, wp.width, wp.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, wp.render_texture, 0);
-
-	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
-		glBindFramebuffer(GL_FRAMEBUFFER, 0);
-		return;
-	}
-
-	glViewport(0, 0, wp.width, wp.height);
-
-	/* Clear FBO before drawing */
-	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-	glClear(GL_COLOR_BUFFER_BIT);
-
-	/* Run shader */
-	glUseProgram(wp.shader_program);
-
-	if (wp.u_time >= 0)
-		glUniform1f(wp.u_time, wp.shader_time);
-	if (wp.u_resolution >= 0)
-		glUniform2f(wp.u_resolution, (float)wp.width, (float)wp.height);
-
-	glBindBuffer(GL_ARRAY_BUFFER, wp.vbo);
-	pos_attrib = glGetAttribLocation(wp.shader_program, "position");
-	glEnableVertexAttribArray(pos_attrib);
-	glVertexAttribPointer(pos_attrib, 2, GL_FLOAT, GL_FALSE, 0, 0);
+	/* Feed real elapsed time to the time uniform */
+	clock_gettime(CLOCK_MONOTONIC, &wp.shader_last_frame);
+	wp.shader_time = (float)ms_since(&wp.shader_start) / 1000.0f;
 
-	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-
-	glDisableVertexAttribArray(pos_attrib);
-	glBindBuffer(GL_ARRAY_BUFFER, 0); /* Clean up state */
-	glUseProgram(0);
+	/* Waiting for the GPU stalls the compositor, so only now and then */
+	measure = ++wp.shader_frames >= SHADER_SAMPLE_FRAMES;
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
-	/* Read pixels into CPU buffer */
-	stride = wp.width * 4;
-	data = malloc(stride * wp.height);
-	if (!data) {
-		glBindFramebuffer(GL_FRAMEBUFFER, 0);
-		return;
+	wl_list_for_each(o, &wp.outputs, link) {
+		if (!o->shader_due)
+			continue;
+		o->shader_due = 0;
+		if (!activity_hidden(o->output))
+			render_shader_output(o);
 	}
 
-	glReadPixels(0, 0, wp.width, wp.height, GL_RGBA, GL_UNSIGNED_BYTE, data);
-
-	/* Convert RGBA to BGRA and flip vertically */
-	buffer = calloc(1, sizeof(WallpaperBuffer));
-	if (buffer) {
-		int x, y;
-		unsigned char *final_data = malloc(stride * wp.height);
-		if (final_data) {
-			for (y = 0; y < wp.height; y++) {
-				int src_y = wp.height - 1 - y; /* Flip */
-				for (x = 0; x < wp.width; x++) {
-					unsigned char *src = data + (src_y * wp.width + x) * 4;
-					unsigned char *dst = final_data + (y * wp.width + x) * 4;
-					dst[0] = src[2]; /* B */
-					dst[1] = src[1]; /* G */
-					dst[2] = src[0]; /* R */
-					dst[3] = src[3]; /* A */
-				}
-			}
-
-			wlr_buffer_init(&buffer->base, &buffer_impl, wp.width, wp.height);
-			buffer->data = final_data;
-			buffer->format = DRM_FORMAT_ARGB8888;
-			buffer->stride = stride;
-
-			if (wp.scene_buffer) {
-				wlr_scene_buffer_set_buffer(wp.scene_buffer, &buffer->base);
-				wlr_scene_buffer_set_dest_size(wp.scene_buffer, wp.width, wp.height);
-			}
-
-			if (wp.buffer)
-				wlr_buffer_drop(&wp.buffer->base);
-			wp.buffer = buffer;
-		} else {
-			free(buffer);
-		}
+	if (measure) {
+		glFinish();
+		wp.shader_frames = 0;
+		govern_shader((float)ms_since(&start));
 	}
 
-	free(data);
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
-
 	/* Restore previous EGL state */
 	eglMakeCurrent(display, prev_draw, prev_read, prev_context);
-
-	/* Increment time */
-	wp.shader_time += 0.033f; /* ~30 FPS */
 }
 
 /* Timer callback for shader animation */
 static int shader_frame_callback(void *data) {
+	WallpaperOutput *o;
+
 	(void)data;
 
-	if (wp.width > 0 && wp.height > 0) {
-		render_shader_frame();
-	}
+	wp.shader_timer_armed = 0;
+	render_shader_frame();
 
-	if (wp.shader_timer && wp.is_shader) {
-		wl_event_source_timer_update(wp.shader_timer, 33); /* ~30 FPS */
+	/* Outputs that skipped the frame try again; the rest wait for the
+	 * scene to show what was just rendered */
+	wl_list_for_each(o, &wp.outputs, link) {
+		if (o->shader_due) {
+			schedule_shader_frame();
+			break;
+		}
 	}
 
 	return 0;
 }
+
+/* Start animating on every output */
+static void start_shader_frames(void) {
+	WallpaperOutput *o;
+
+	wl_list_for_each(o, &wp.outputs, link)
+		o->shader_due = 1;
+	schedule_shader_frame();
+}
 #endif /* EXTRAS */
 
 static void load_random_image(void) {
@@ -966,7 +3881,7 @@ static void load_random_image(void) {
 
 	/* If we don't have a current directory, pick one */
 	if (wp.current_dir[0] == '\0') {
-		subdir = pick_random_subdir(wp.base_path);
+		subdir = pick_random_subdir();
 		if (!subdir) {
 			load_gradient_fallback();
 			return;
@@ -982,11 +3897,10 @@ static void load_random_image(void) {
 	if (shader) {
 		if (load_shader_file(shader)) {
 			free(shader);
+			drop_prefetch();
 			load_gradient_fallback();
-			/* Start shader animation timer */
-			if (wp.shader_timer) {
-				wl_event_source_timer_update(wp.shader_timer, 1);
-			}
+			start_shader_frames();
+			schedule_shader_warmup();
 			return;
 		}
 		free(shader);
@@ -994,10 +3908,14 @@ static void load_random_image(void) {
 	cleanup_shader();
 #endif
 
+	/* Usually already decoded during idle time */
+	if (take_prefetch())
+		return;
+
 	image = pick_random_image(wp.current_dir);
 	if (!image) {
 		/* No images in current dir, try picking a new subdir */
-		subdir = pick_random_subdir(wp.base_path);
+		subdir = pick_random_subdir();
 		if (subdir) {
 			strncpy(wp.current_dir, subdir, MAX_PATH - 1);
 			free(subdir);
@@ -1022,12 +3940,47 @@ static void load_random_image(void) {
 
 	if (image) {
 		load_image_file(image);
+		history_push(image);
 		free(image);
 	} else {
 		load_gradient_fallback();
 	}
 }
 
+static int any_output_visible(void) {
+	WallpaperOutput *o;
+
+	wl_list_for_each(o, &wp.outputs, link) {
+		if (!activity_hidden(o->output))
+			return 1;
+	}
+	return 0;
+}
+
+/* Make the slideshow change skipped while nothing could be seen */
+static void resume_slideshow(void) {
+	if (!wp.slideshow_due || !any_output_visible())
+		return;
+	wp.slideshow_due = 0;
+	wallpaper_timer_callback(NULL);
+}
+
+/* Catch up with work paused while outputs could not be seen */
+static void handle_activity(struct wl_listener *listener, void *data) {
+#ifdef EXTRAS
+	WallpaperOutput *o;
+
+	if (wp.is_shader) {
+		wl_list_for_each(o, &wp.outputs, link) {
+			if (!activity_hidden(o->output))
+				request_shader_frame(o);
+		}
+	}
+#endif
+	arm_animation_timer();
+	resume_slideshow();
+}
+
 void wallpaper_init(struct wlr_scene *scene, struct wlr_renderer *renderer,
 		const char *dir, int interval) {
 	char *expanded;
@@ -1040,6 +3993,28 @@ void wallpaper_init(struct wlr_scene *scene, struct wlr_renderer *renderer,
 	wp.renderer = renderer;
 	wp.interval = interval;
 	wp.scale_mode = SCALE_COVER;
+	wp.filter = WallpaperFilterLanczos3;
+	wp.transition = WallpaperTransitionNone;
+	wp.transition_ms = 400;
+	wp.anim_limit = (size_t)128 << 20;
+	wp.job_fd = -1;
+	wl_list_init(&wp.outputs);
+	wl_list_init(&wp.pending);
+	wl_list_init(&wp.done);
+	wl_list_init(&wp.dirs);
+	wl_list_init(&wp.cache);
+#ifdef EXTRAS
+	wl_list_init(&wp.programs);
+	wp.shader_scale = wp.shader_scale_max = 1.0f;
+	wp.shader_frame_ms = SHADER_FRAME_MS;
+#endif
+	wp.cache_limit = (size_t)256 << 20;
+	wp.disk_cache_limit = (size_t)1024 << 20;
+	wp.disk_cache_max_age = 30 * 24 * 60 * 60;
+	wp.inotify_fd = -1;
+	wp.base_wd = -1;
+	wp.activity.notify = handle_activity;
+	activity_add_listener(&wp.activity);
 
 	expanded = expand_path(dir);
 	if (!expanded) {
@@ -1054,6 +4029,30 @@ void wallpaper_init(struct wlr_scene *scene, struct wlr_renderer *renderer,
 		return;
 	}
 
+	/* Scaled images are kept under $XDG_CACHE_HOME/dwl/wallpapers */
+	if (getenv("XDG_CACHE_HOME") && getenv("XDG_CACHE_HOME")[0] == '/')
+		snprintf(wp.disk_cache_dir, MAX_PATH, "%s/dwl/wallpapers", getenv("XDG_CACHE_HOME"));
+	else if (getenv("HOME"))
+		snprintf(wp.disk_cache_dir, MAX_PATH, "%s/.cache/dwl/wallpapers", getenv("HOME"));
+	if (wp.disk_cache_dir[0] != '\0' && !make_dirs(wp.disk_cache_dir)) {
+		fprintf(stderr, "wallpaper: cannot create %s, disk cache disabled\n", wp.disk_cache_dir);
+		wp.disk_cache_dir[0] = '\0';
+	}
+#ifdef EXTRAS
+	/* Linked shader programs next to them, under dwl/shaders */
+	if (wp.disk_cache_dir[0] != '\0') {
+		snprintf(wp.program_cache_dir, MAX_PATH, "%s", wp.disk_cache_dir);
+		strcpy(strrchr(wp.program_cache_dir, '/'), "/shaders");
+		if (!make_dirs(wp.program_cache_dir))
+			wp.program_cache_dir[0] = '\0';
+	}
+#endif
+
+	/* Index updates come from inotify; without it every pick rescans */
+	wp.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (wp.inotify_fd < 0)
+		fprintf(stderr, "wallpaper: inotify unavailable: %s\n", strerror(errno));
+
 	/* Check for .default file to set startup directory */
 	default_dir = read_default_dir(wp.base_path);
 	if (default_dir) {
@@ -1063,15 +4062,26 @@ void wallpaper_init(struct wlr_scene *scene, struct wlr_renderer *renderer,
 		fprintf(stderr, "wallpaper: using default directory %s\n", wp.current_dir);
 	}
 
-	/* Create scene buffer */
-	wp.scene_buffer = wlr_scene_buffer_create(&scene->tree, NULL);
-	if (wp.scene_buffer) {
-		wlr_scene_node_lower_to_bottom(&wp.scene_buffer->node);
+	/* Create tree holding one scene buffer per output */
+	wp.tree = wlr_scene_tree_create(&scene->tree);
+	if (wp.tree) {
+		wlr_scene_node_lower_to_bottom(&wp.tree->node);
 	}
 }
 
 void wallpaper_set_event_loop(struct wl_event_loop *loop) {
 	wp.event_loop = loop;
+	start_worker();
+
+	if (wp.inotify_fd >= 0 && loop) {
+		wp.inotify_source = wl_event_loop_add_fd(loop, wp.inotify_fd,
+				WL_EVENT_READABLE, index_inotify_callback, NULL);
+	}
+
+	if (loop) {
+		wp.transition_timer = wl_event_loop_add_timer(loop, transition_callback, NULL);
+		wp.anim_timer = wl_event_loop_add_timer(loop, animation_callback, NULL);
+	}
 
 	if (wp.interval > 0 && loop) {
 		wp.timer = wl_event_loop_add_timer(loop, wallpaper_timer_callback, NULL);
@@ -1085,20 +4095,103 @@ void wallpaper_set_event_loop(struct wl_event_loop *loop) {
 	if (loop) {
 		wp.shader_timer = wl_event_loop_add_timer(loop, shader_frame_callback, NULL);
 		/* If shader was loaded during init but couldn't render, trigger it now */
-		if (wp.is_shader && wp.shader_timer && wp.width > 0 && wp.height > 0) {
-			wl_event_source_timer_update(wp.shader_timer, 1);
-		}
+		start_shader_frames();
 	}
 #endif
 }
 
+void wallpaper_set_filter(int filter) {
+	if (filter < WallpaperFilterBox || filter > WallpaperFilterLanczos3)
+		return;
+	wp.filter = filter;
+}
+
+void wallpaper_set_scene_scaling(int enable) {
+	if (wp.scene_scaling == !!enable)
+		return;
+	wp.scene_scaling = !!enable;
+	cache_clear(); /* entries are shaped for the other mode */
+}
+
+void wallpaper_set_transition(int transition, int ms) {
+	if (transition < WallpaperTransitionNone || transition > WallpaperTransitionSlide)
+		return;
+	wp.transition = transition;
+	wp.transition_ms = ms;
+}
+
+void wallpaper_set_allocator(struct wlr_allocator *allocator) {
+#ifdef EXTRAS
+	/* Shader frames use the same format as image wallpapers */
+	wlr_drm_format_finish(&wp.shader_format);
+	memset(&wp.shader_format, 0, sizeof(wp.shader_format));
+	wp.shader_format.format = DRM_FORMAT_ARGB8888;
+	if (!wlr_drm_format_add(&wp.shader_format, DRM_FORMAT_MOD_INVALID))
+		return;
+	wp.allocator = allocator;
+	wp.gpu_failed = 0;
+#endif
+}
+
+void wallpaper_set_shader_quality(float scale, int budget_ms) {
+#ifdef EXTRAS
+	if (scale < SHADER_SCALE_MIN)
+		scale = SHADER_SCALE_MIN;
+	if (scale > 1.0f)
+		scale = 1.0f;
+	wp.shader_scale = wp.shader_scale_max = scale;
+	wp.shader_budget_ms = budget_ms > 0 ? budget_ms : 0;
+	wp.shader_frame_ms = SHADER_FRAME_MS;
+	wp.shader_cost = 0.0f;
+#endif
+}
+
+void wallpaper_set_disk_cache(int megabytes, int days) {
+	/* The worker owns these once it runs */
+	if (wp.worker_running)
+		return;
+	if (megabytes <= 0 || days <= 0) {
+		wp.disk_cache_dir[0] = '\0';
+#ifdef EXTRAS
+		wp.program_cache_dir[0] = '\0';
+#endif
+		return;
+	}
+	wp.disk_cache_limit = (size_t)megabytes << 20;
+	wp.disk_cache_max_age = (time_t)days * 24 * 60 * 60;
+}
+
+void wallpaper_set_animation_size(int megabytes) {
+	/* The worker owns this once it runs */
+	if (wp.worker_running || megabytes < 0)
+		return;
+	wp.anim_limit = (size_t)megabytes << 20;
+}
+
+void wallpaper_set_cache_size(int megabytes) {
+	if (megabytes < 0)
+		return;
+	wp.cache_limit = (size_t)megabytes << 20;
+	cache_trim(0);
+}
+
 void wallpaper_cleanup(void) {
+	stop_worker();
+	wl_list_remove(&wp.activity.link);
+
 #ifdef EXTRAS
 	if (wp.shader_timer) {
 		wl_event_source_remove(wp.shader_timer);
 		wp.shader_timer = NULL;
+		wp.shader_timer_armed = 0;
+	}
+	warmup_clear();
+	if (wp.warmup_timer) {
+		wl_event_source_remove(wp.warmup_timer);
+		wp.warmup_timer = NULL;
 	}
 	cleanup_shader();
+	program_cache_clear();
 #endif
 
 	if (wp.timer) {
@@ -1106,23 +4199,80 @@ void wallpaper_cleanup(void) {
 		wp.timer = NULL;
 	}
 
-	if (wp.buffer) {
-		wlr_buffer_drop(&wp.buffer->base);
-		wp.buffer = NULL;
+	if (wp.prefetch_idle) {
+		wl_event_source_remove(wp.prefetch_idle);
+		wp.prefetch_idle = NULL;
 	}
+
+	index_clear();
+	if (wp.inotify_source) {
+		wl_event_source_remove(wp.inotify_source);
+		wp.inotify_source = NULL;
+	}
+	if (wp.inotify_fd >= 0) {
+		close(wp.inotify_fd);
+		wp.inotify_fd = -1;
+	}
+
+	while (!wl_list_empty(&wp.outputs)) {
+		WallpaperOutput *o = wl_container_of(wp.outputs.next, o, link);
+		wallpaper_output_remove(o->output);
+	}
+	if (wp.transition_timer) {
+		wl_event_source_remove(wp.transition_timer);
+		wp.transition_timer = NULL;
+	}
+	if (wp.anim_timer) {
+		wl_event_source_remove(wp.anim_timer);
+		wp.anim_timer = NULL;
+	}
+
+	cache_clear();
+	history_clear();
+
+#ifdef EXTRAS
+	wlr_drm_format_finish(&wp.shader_format);
+	wp.allocator = NULL;
+#endif
+}
+
+/* Show a history entry again, continuing the slideshow from its directory */
+static void show_history(int pos) {
+	HistoryEntry *h = history_at(pos);
+	char *slash;
+
+	if (!h)
+		return;
+
+	wp.history_pos = pos;
+	wp.scale_mode = h->scale_mode;
+	strncpy(wp.current_dir, h->path, MAX_PATH - 1);
+	slash = strrchr(wp.current_dir, '/');
+	if (slash)
+		*slash = '\0';
+
+#ifdef EXTRAS
+	cleanup_shader();
+#endif
+	load_image_file(h->path);
 }
 
 void wallpaper_next_image(void) {
+	/* Walk forward again after going back */
+	if (wp.history_pos + 1 < wp.history_len) {
+		show_history(wp.history_pos + 1);
+		return;
+	}
 	load_random_image();
 }
 
 void wallpaper_prev_image(void) {
-	/* With random selection, prev just loads another random image */
-	load_random_image();
+	if (wp.history_pos > 0)
+		show_history(wp.history_pos - 1);
 }
 
 void wallpaper_next_dir(void) {
-	char *subdir = pick_random_subdir(wp.base_path);
+	char *subdir = pick_random_subdir();
 	if (subdir) {
 		strncpy(wp.current_dir, subdir, MAX_PATH - 1);
 		free(subdir);
@@ -1132,11 +4282,24 @@ void wallpaper_next_dir(void) {
 }
 
 void wallpaper_prev_dir(void) {
-	/* With random selection, prev just picks another random dir */
-	wallpaper_next_dir();
+	HistoryEntry *h;
+	int i;
+
+	/* Go back to the last image shown from another directory */
+	for (i = wp.history_pos - 1; (h = history_at(i)); i--) {
+		if (!in_dir(h->path, wp.current_dir)) {
+			show_history(i);
+			return;
+		}
+	}
 }
 
 int wallpaper_timer_callback(void *data) {
+	/* Stop until an output can be seen, then change once */
+	if (!any_output_visible()) {
+		wp.slideshow_due = 1;
+		return 0;
+	}
 	load_random_image();
 
 	if (wp.timer && wp.interval > 0) {
@@ -1146,43 +4309,119 @@ int wallpaper_timer_callback(void *data) {
 	return 0;
 }
 
-void wallpaper_resize(int width, int height) {
-	if (width == wp.width && height == wp.height)
+void wallpaper_output_update(struct wlr_output *output, const struct wlr_box *box) {
+	WallpaperOutput *o;
+	int buf_width, buf_height;
+
+	if (!wp.tree)
+		return;
+
+	if (!output->enabled || box->width <= 0 || box->height <= 0) {
+		wallpaper_output_remove(output);
+		return;
+	}
+
+	/* Render at the output's physical resolution */
+	wlr_output_transformed_resolution(output, &buf_width, &buf_height);
+
+	o = find_output(output);
+	if (!o) {
+		o = calloc(1, sizeof(*o));
+		if (!o)
+			return;
+		o->scene_buffer = wlr_scene_buffer_create(wp.tree, NULL);
+		if (!o->scene_buffer) {
+			free(o);
+			return;
+		}
+		o->output = output;
+		o->id = ++wp.next_output_id;
+		wl_list_insert(wp.outputs.prev, &o->link);
+#ifdef EXTRAS
+		o->frame_done.notify = handle_frame_done;
+		wl_signal_add(&o->scene_buffer->events.frame_done, &o->frame_done);
+#endif
+	}
+
+	if (o->x != box->x || o->y != box->y) {
+		end_transition(o);
+		o->x = box->x;
+		o->y = box->y;
+		place_buffer(o, o->scene_buffer, o->buffer);
+		if (o->anim && !o->anim->scaled)
+			place_frame(o, &o->buffer->base, o->anim->scale_mode);
+	}
+
+	if (o->width == box->width && o->height == box->height
+			&& o->buf_width == buf_width && o->buf_height == buf_height)
 		return;
 
-	wp.width = width;
-	wp.height = height;
+	end_transition(o);
+	stop_animation(o);
+	o->width = box->width;
+	o->height = box->height;
+	o->buf_width = buf_width;
+	o->buf_height = buf_height;
+
+	/* Stretch the old wallpaper until the rescaled one arrives */
+	if (o->buffer)
+		place_buffer(o, o->scene_buffer, NULL);
 
 #ifdef EXTRAS
 	/* If shader is active, schedule a render via timer instead of rendering immediately.
 	 * Direct render from updatemons() causes freeze - wlroots EGL state conflict. */
 	if (wp.is_shader) {
-		if (wp.shader_timer) {
-			wl_event_source_timer_update(wp.shader_timer, 1); /* Render in 1ms */
-		}
 		/* If no timer yet, it will render once event loop is ready */
+		request_shader_frame(o);
 		return;
 	}
 #endif
 
-	/* Reload current image at new size */
-	if (wp.current_file[0] != '\0') {
-		load_image_file(wp.current_file);
+	/* Reload current image at the output's new size, unless the slideshow
+	 * waited for an output to be seen and moves on anyway */
+	if (wp.slideshow_due && !activity_hidden(output)) {
+		resume_slideshow();
+	} else if (wp.current_file[0] != '\0') {
+		submit_job(wp.current_file, o, 0);
 	} else {
 		load_random_image();
 	}
 }
 
+void wallpaper_output_remove(struct wlr_output *output) {
+	WallpaperOutput *o = find_output(output);
+
+	if (!o)
+		return;
+
+	/* Results still in flight are dropped by finish_job */
+	wl_list_remove(&o->link);
+#ifdef EXTRAS
+	wl_list_remove(&o->frame_done.link);
+#endif
+	end_transition(o);
+	stop_animation(o);
+	wlr_scene_node_destroy(&o->scene_buffer->node);
+	if (o->buffer)
+		wlr_buffer_unlock(&o->buffer->base);
+	drop_staged(o);
+#ifdef EXTRAS
+	destroy_swapchain(o);
+	drop_shader_pool(o);
+#endif
+	free(o);
+}
+
 void wallpaper_disable(void) {
-	if (wp.scene_buffer)
-		wlr_scene_node_set_enabled(&wp.scene_buffer->node, false);
+	if (wp.tree)
+		wlr_scene_node_set_enabled(&wp.tree->node, false);
 }
 
 void wallpaper_enable(void) {
-	if (wp.scene_buffer)
-		wlr_scene_node_set_enabled(&wp.scene_buffer->node, true);
+	if (wp.tree)
+		wlr_scene_node_set_enabled(&wp.tree->node, true);
 }
 
 int wallpaper_is_enabled(void) {
-	return wp.scene_buffer && wp.scene_buffer->node.enabled;
+	return wp.tree && wp.tree->node.enabled;
 }
@@ -2,9 +2,12 @@
 #ifndef WALLPAPER_H
 #define WALLPAPER_H
 
+#include <wlr/types/wlr_output.h>
 #include <wlr/types/wlr_scene.h>
 #include <wlr/render/wlr_renderer.h>
 
+struct wlr_allocator;
+
 /* Scaling modes for config */
 enum {
 	WallpaperTile,    /* Tile image without scaling */
@@ -13,23 +16,69 @@ enum {
 	WallpaperCover,   /* Cover screen (may crop) */
 };
 
+/* Resampling filters for config */
+enum {
+	WallpaperFilterBox,      /* Fastest, soft when upscaling */
+	WallpaperFilterBilinear, /* Smooth */
+	WallpaperFilterLanczos3, /* Sharpest, slowest */
+};
+
+/* Transitions between wallpapers for config */
+enum {
+	WallpaperTransitionNone,  /* Swap at once */
+	WallpaperTransitionFade,  /* Crossfade */
+	WallpaperTransitionWipe,  /* New wallpaper uncovered from the left */
+	WallpaperTransitionSlide, /* New wallpaper pushes the old one out */
+};
+
 /* Initialize wallpaper system */
 void wallpaper_init(struct wlr_scene *scene, struct wlr_renderer *renderer,
 		const char *dir, int interval);
 
+/* Set resampling filter used for fit, cover and center */
+void wallpaper_set_filter(int filter);
+
+/* Let the scene scale fit, cover and center wallpapers: only the visible
+ * part of the image is kept, at most at the output's resolution, and the
+ * root background shows as the border */
+void wallpaper_set_scene_scaling(int enable);
+
+/* Set transition between wallpapers and its length */
+void wallpaper_set_transition(int transition, int ms);
+
+/* Set allocator for buffers shader wallpapers render into on the GPU */
+void wallpaper_set_allocator(struct wlr_allocator *allocator);
+
+/* Set highest render scale of shader wallpapers (0.25-1.0) and the time
+ * per frame a shader may take before it is rendered smaller or less often,
+ * 0 to always render at that scale */
+void wallpaper_set_shader_quality(float scale, int budget_ms);
+
+/* Set memory budget for the frames of one animated wallpaper. Larger
+ * animations are scaled by the renderer or decoded again as they play.
+ * Must be called before wallpaper_set_event_loop. */
+void wallpaper_set_animation_size(int megabytes);
+
+/* Set memory budget for cached scaled wallpapers, 0 disables the cache */
+void wallpaper_set_cache_size(int megabytes);
+
+/* Set size and age limits of the on-disk cache, 0 disables it and the
+ * saved shader programs. Must be called before wallpaper_set_event_loop. */
+void wallpaper_set_disk_cache(int megabytes, int days);
+
 /* Clean up wallpaper resources */
 void wallpaper_cleanup(void);
 
-/* Load next random image in current directory */
+/* Load next image, walking forward through history first */
 void wallpaper_next_image(void);
 
-/* Load previous image in current directory */
+/* Go back to the previously shown image */
 void wallpaper_prev_image(void);
 
 /* Switch to a random directory and load random image from it */
 void wallpaper_next_dir(void);
 
-/* Switch to another random directory (same as next_dir with random selection) */
+/* Go back to the last image shown from another directory */
 void wallpaper_prev_dir(void);
 
 /* Timer callback for slideshow */
@@ -38,13 +87,16 @@ int wallpaper_timer_callback(void *data);
 /* Set the event loop for timer */
 void wallpaper_set_event_loop(struct wl_event_loop *loop);
 
-/* Resize wallpaper to fit output dimensions */
-void wallpaper_resize(int width, int height);
+/* Add or update an output's wallpaper at its layout box */
+void wallpaper_output_update(struct wlr_output *output, const struct wlr_box *box);
+
+/* Drop an output's wallpaper */
+void wallpaper_output_remove(struct wlr_output *output);
 
-/* Disable wallpaper (hide scene buffer) */
+/* Disable wallpaper (hide scene buffers) */
 void wallpaper_disable(void);
 
-/* Enable wallpaper (show scene buffer) */
+/* Enable wallpaper (show scene buffers) */
 void wallpaper_enable(void);
 
 /* Check if wallpaper is enabled */
@@ -0,0 +1,267 @@
+/* pixel_test.c - check the vector pixel kernels against the scalar ones
+ *
+ * pixel.c is built into this program so each SSE2, AVX2 or NEON kernel
+ * can be run directly, not only the one the dispatch picks on this CPU.
+ * Every length from 0 to MAX_LEN is tried with source and destination
+ * at every offset up to a full vector, then the public entry points are
+ * checked the same way. Premultiplying is also run over every alpha and
+ * channel value. Prints one line per failure and exits non-zero.
+ */
+#include "pixel.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_LEN 67
+#define MAX_OFFSET 8 /* in pixels, one AVX2 register */
+#define GUARD 0x5a
+
+typedef size_t (*SwizzleFn)(unsigned char *, const unsigned char *, size_t);
+typedef size_t (*PremultiplyFn)(uint32_t *, const unsigned char *, size_t);
+typedef size_t (*FillFn)(uint32_t *, uint32_t, size_t);
+
+typedef struct {
+	const char *name;
+	int (*supported)(void);
+	SwizzleFn swizzle;
+	PremultiplyFn premultiply;
+	FillFn fill;
+} Path;
+
+static int always(void) {
+	return 1;
+}
+
+#ifdef PIXEL_X86
+static int has_avx2(void) {
+	return __builtin_cpu_supports("avx2");
+}
+#endif
+
+static const Path paths[] = {
+#ifdef PIXEL_X86
+	{ "sse2", always, swizzle_sse2, premultiply_sse2, fill_sse2 },
+	{ "avx2", has_avx2, swizzle_avx2, premultiply_avx2, fill_avx2 },
+#endif
+#ifdef PIXEL_NEON
+	{ "neon", always, swizzle_neon, premultiply_neon, fill_neon },
+#endif
+	{ NULL, NULL, NULL, NULL, NULL },
+};
+
+/* Entry points wrapped to look like a vector kernel that leaves no tail */
+static size_t swizzle_public(unsigned char *dst, const unsigned char *src, size_t n) {
+	pixel_swizzle(dst, src, n);
+	return n;
+}
+
+static size_t premultiply_public(uint32_t *dst, const unsigned char *src, size_t n) {
+	pixel_premultiply_argb(dst, src, n);
+	return n;
+}
+
+static size_t fill_public(uint32_t *dst, uint32_t value, size_t n) {
+	pixel_fill(dst, value, n);
+	return n;
+}
+
+static const Path public_path = {
+	"dispatch", always, swizzle_public, premultiply_public, fill_public,
+};
+
+static int failures;
+
+static void fail(const char *path, const char *kernel, size_t n,
+		size_t src_off, size_t dst_off, const char *what) {
+	if (failures++ < 50)
+		printf("FAIL %s %s n=%zu src+%zu dst+%zu: %s\n",
+				path, kernel, n, src_off, dst_off, what);
+}
+
+static uint32_t rng = 2463534242u;
+
+static uint32_t next_random(void) {
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	return rng;
+}
+
+static void fill_random(unsigned char *p, size_t len) {
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		p[i] = (unsigned char)next_random();
+}
+
+/* Bytes outside [start, start + len) must still be GUARD */
+static int guard_intact(const unsigned char *p, size_t size, size_t start, size_t len) {
+	size_t i;
+
+	for (i = 0; i < size; i++)
+		if ((i < start || i >= start + len) && p[i] != GUARD)
+			return 0;
+	return 1;
+}
+
+static void check_swizzle(const Path *path) {
+	unsigned char src[(MAX_LEN + MAX_OFFSET) * 4 + 4];
+	unsigned char dst[sizeof(src)], want[sizeof(src)], in_place[sizeof(src)];
+	size_t n, so, doff, done;
+
+	for (n = 0; n <= MAX_LEN; n++)
+		for (so = 0; so < MAX_OFFSET * 4; so++)
+			for (doff = 0; doff < MAX_OFFSET * 4; doff++) {
+				fill_random(src, sizeof(src));
+				memset(dst, GUARD, sizeof(dst));
+				swizzle_scalar(want, src + so, n);
+				done = path->swizzle(dst + doff, src + so, n);
+				swizzle_scalar(dst + doff + done * 4, src + so + done * 4, n - done);
+				if (done > n)
+					fail(path->name, "swizzle", n, so, doff, "vector part longer than n");
+				else if (memcmp(dst + doff, want, n * 4) != 0)
+					fail(path->name, "swizzle", n, so, doff, "pixels differ");
+				else if (!guard_intact(dst, sizeof(dst), doff, n * 4))
+					fail(path->name, "swizzle", n, so, doff, "wrote outside dst");
+
+				/* dst may be the same as src */
+				if (doff != 0)
+					continue;
+				memcpy(in_place, src, sizeof(src));
+				done = path->swizzle(in_place + so, in_place + so, n);
+				swizzle_scalar(in_place + so + done * 4, in_place + so + done * 4, n - done);
+				if (memcmp(in_place + so, want, n * 4) != 0)
+					fail(path->name, "swizzle in place", n, so, so, "pixels differ");
+			}
+}
+
+static void check_premultiply(const Path *path) {
+	unsigned char src[(MAX_LEN + MAX_OFFSET) * 4 + 4];
+	uint32_t dst[MAX_LEN + MAX_OFFSET], want[MAX_LEN];
+	unsigned char *all;
+	uint32_t *all_dst, *all_want;
+	size_t n, so, doff, done, i;
+
+	for (n = 0; n <= MAX_LEN; n++)
+		for (so = 0; so < MAX_OFFSET * 4; so++)
+			for (doff = 0; doff < MAX_OFFSET; doff++) {
+				fill_random(src, sizeof(src));
+				memset(dst, GUARD, sizeof(dst));
+				premultiply_scalar(want, src + so, n);
+				done = path->premultiply(dst + doff, src + so, n);
+				premultiply_scalar(dst + doff + done, src + so + done * 4, n - done);
+				if (done > n)
+					fail(path->name, "premultiply", n, so, doff, "vector part longer than n");
+				else if (memcmp(dst + doff, want, n * 4) != 0)
+					fail(path->name, "premultiply", n, so, doff, "pixels differ");
+				else if (!guard_intact((unsigned char *)dst, sizeof(dst), doff * 4, n * 4))
+					fail(path->name, "premultiply", n, so, doff, "wrote outside dst");
+			}
+
+	/* Every alpha with every channel value, in each of the three channels */
+	n = 256 * 256;
+	all = malloc(n * 4);
+	all_dst = malloc(n * 4);
+	all_want = malloc(n * 4);
+	if (!all || !all_dst || !all_want) {
+		fail(path->name, "premultiply", n, 0, 0, "out of memory");
+		goto out;
+	}
+	for (i = 0; i < n; i++) {
+		all[i * 4] = (unsigned char)(i >> 8);
+		all[i * 4 + 1] = (unsigned char)i;
+		all[i * 4 + 2] = (unsigned char)(i * 7);
+		all[i * 4 + 3] = (unsigned char)(255 - i);
+	}
+	premultiply_scalar(all_want, all, n);
+	done = path->premultiply(all_dst, all, n);
+	premultiply_scalar(all_dst + done, all + done * 4, n - done);
+	for (i = 0; i < n; i++)
+		if (all_dst[i] != all_want[i]) {
+			fail(path->name, "premultiply", n, 0, 0, "differs over all alpha and channel values");
+			break;
+		}
+	/* The scalar version itself against the exact quotient */
+	for (i = 0; i < n; i++)
+		if ((all_want[i] >> 16 & 0xff) != (all[i * 4 + 1] * all[i * 4] + 127u) / 255) {
+			fail("scalar", "premultiply", n, 0, 0, "not rounded (c * a + 127) / 255");
+			break;
+		}
+out:
+	free(all);
+	free(all_dst);
+	free(all_want);
+}
+
+static void check_fill(const Path *path) {
+	uint32_t dst[MAX_LEN + MAX_OFFSET], want[MAX_LEN];
+	uint32_t value;
+	size_t n, doff, done;
+
+	for (n = 0; n <= MAX_LEN; n++)
+		for (doff = 0; doff < MAX_OFFSET; doff++) {
+			value = next_random();
+			memset(dst, GUARD, sizeof(dst));
+			fill_scalar(want, value, n);
+			done = path->fill(dst + doff, value, n);
+			fill_scalar(dst + doff + done, value, n - done);
+			if (done > n)
+				fail(path->name, "fill", n, 0, doff, "vector part longer than n");
+			else if (memcmp(dst + doff, want, n * 4) != 0)
+				fail(path->name, "fill", n, 0, doff, "pixels differ");
+			else if (!guard_intact((unsigned char *)dst, sizeof(dst), doff * 4, n * 4))
+				fail(path->name, "fill", n, 0, doff, "wrote outside dst");
+		}
+}
+
+/* Rows of width pixels with padded strides, against swizzle_scalar row by row */
+static void check_swizzle_flip(void) {
+	enum { MAX_W = MAX_LEN, MAX_H = 5, PAD = 3 };
+	unsigned char src[MAX_H * (MAX_W * 4 + PAD) + MAX_OFFSET * 4];
+	unsigned char dst[sizeof(src)], want[sizeof(src)];
+	size_t src_stride, dst_stride, so, doff;
+	int w, h, y;
+
+	for (w = 0; w <= MAX_W; w++)
+		for (h = 0; h <= MAX_H; h++)
+			for (so = 0; so < MAX_OFFSET * 4; so += 3)
+				for (doff = 0; doff < MAX_OFFSET * 4; doff += 5) {
+					src_stride = (size_t)w * 4 + (so % (PAD + 1));
+					dst_stride = (size_t)w * 4 + (doff % (PAD + 1));
+					fill_random(src, sizeof(src));
+					memset(dst, GUARD, sizeof(dst));
+					memset(want, GUARD, sizeof(want));
+					for (y = 0; y < h; y++)
+						swizzle_scalar(want + doff + y * dst_stride,
+								src + so + (h - 1 - y) * src_stride, (size_t)w);
+					pixel_swizzle_flip(dst + doff, dst_stride, src + so, src_stride, w, h);
+					if (memcmp(dst, want, sizeof(dst)) != 0)
+						fail("dispatch", "swizzle_flip", (size_t)w * h, so, doff,
+								"pixels differ or written outside rows");
+				}
+}
+
+static void check_path(const Path *path) {
+	if (!path->supported()) {
+		printf("skip %s: not supported by this CPU\n", path->name);
+		return;
+	}
+	check_swizzle(path);
+	check_premultiply(path);
+	check_fill(path);
+	printf("ok %s\n", path->name);
+}
+
+int main(void) {
+	const Path *path;
+
+	for (path = paths; path->name; path++)
+		check_path(path);
+	check_path(&public_path);
+	check_swizzle_flip();
+	printf("ok swizzle_flip\n");
+	if (failures)
+		printf("%d failures\n", failures);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,178 @@
+/* scripting_test.c - check that hooks leave the Wren heap flat
+ *
+ * scripting.c is built into this program with the patched Wren sources,
+ * and dwl and the wallpaper code are replaced by stubs. A clientFocus
+ * hook reading its clients is run for FOCUS_EVENTS focus changes, with
+ * the queue drained after each one. Every DESTROY_EVERY changes a client
+ * is destroyed and another created at the same address.
+ *
+ * Wren allocates through WrenConfiguration.reallocateFn, which is set by
+ * wrapping wrenNewVM, so the bytes it holds can be counted. After a
+ * warm-up the heap is collected every CHECK_EVERY events and must not
+ * grow. Prints one line per failure and exits non-zero.
+ */
+#include "scripting.c"
+
+#include <malloc.h>
+
+#define FOCUS_EVENTS 1000000
+#define WARMUP 10000
+#define CHECK_EVERY 100000
+#define DESTROY_EVERY 1000
+#define NCLIENTS 16
+#define HEAP_SLACK 4096 /* bytes a checkpoint may be above the first */
+
+static const char *hooks =
+	"var Seen = 0\n"
+	"var Lost = 0\n"
+	"Hooks.on(\"clientFocus\", Fn.new {|c, old|\n"
+	"  var s = c.title + \" \" + c.appId + \" %(c.tags)\"\n"
+	"  if (old != null && old.isAlive) s = s + old.title\n"
+	"  Seen = Seen + s.count\n"
+	"})\n"
+	"Hooks.on(\"clientDestroy\", Fn.new {|c|\n"
+	"  if (c.isAlive || c.title == null) Lost = Lost + 1\n"
+	"})\n";
+
+typedef struct {
+	char title[32];
+	unsigned int tags;
+} Client;
+
+static Client clients[NCLIENTS];
+static size_t heap_bytes, heap_peak;
+static int failures;
+
+/* dwl, as far as the hooks above reach */
+void script_spawn(const char *cmd) {}
+void script_quit(void) {}
+void script_focusstack(int dir) {}
+void script_view(unsigned int tag) {}
+void script_tag(unsigned int t) {}
+void script_toggleview(unsigned int tag) {}
+void script_toggletag(unsigned int tag) {}
+void script_setmfact(float f) {}
+void script_incnmaster(int n) {}
+void script_killclient(void) {}
+void script_togglefloating(void) {}
+void script_togglefullscreen(void) {}
+void script_focusmon(int dir) {}
+void script_tagmon(int dir) {}
+const char *script_client_title(void *client) { return ((Client *)client)->title; }
+const char *script_client_appid(void *client) { return "test"; }
+unsigned int script_client_tags(void *client) { return ((Client *)client)->tags; }
+const char *script_monitor_name(void *monitor) { return "TEST-1"; }
+unsigned int script_monitor_tags(void *monitor) { return 1; }
+
+void wallpaper_disable(void) {}
+void wallpaper_enable(void) {}
+int wallpaper_is_enabled(void) { return 0; }
+void wallpaper_next_image(void) {}
+void wallpaper_prev_image(void) {}
+void wallpaper_next_dir(void) {}
+void wallpaper_prev_dir(void) {}
+
+static void *count_reallocate(void *memory, size_t size, void *user_data) {
+	void *grown;
+
+	if (memory)
+		heap_bytes -= malloc_usable_size(memory);
+	if (size == 0) {
+		free(memory);
+		return NULL;
+	}
+	if (!(grown = realloc(memory, size))) {
+		if (memory)
+			heap_bytes += malloc_usable_size(memory);
+		return NULL;
+	}
+	heap_bytes += malloc_usable_size(grown);
+	if (heap_bytes > heap_peak)
+		heap_peak = heap_bytes;
+	return grown;
+}
+
+WrenVM *__real_wrenNewVM(WrenConfiguration *config);
+
+WrenVM *__wrap_wrenNewVM(WrenConfiguration *config) {
+	config->reallocateFn = count_reallocate;
+	return __real_wrenNewVM(config);
+}
+
+static void fail(const char *what, long event) {
+	if (failures++ < 50)
+		printf("FAIL after %ld events: %s\n", event, what);
+}
+
+int main(void) {
+	struct wl_event_loop *loop;
+	size_t baseline = 0;
+	int live_objects, i;
+	long n;
+
+	/* Keep the user's init.wren out of it */
+	setenv("HOME", "/nonexistent", 1);
+	if (!scripting_init()) {
+		printf("FAIL: scripting_init\n");
+		return 1;
+	}
+	if (!scripting_eval(hooks)) {
+		printf("FAIL: loading hooks\n");
+		return 1;
+	}
+	if (!(loop = wl_event_loop_create())) {
+		printf("FAIL: wl_event_loop_create\n");
+		return 1;
+	}
+	scripting_set_event_loop(loop);
+
+	for (i = 0; i < NCLIENTS; i++) {
+		snprintf(clients[i].title, sizeof(clients[i].title), "client %d", i);
+		clients[i].tags = 1u << (i % 9);
+		scripting_on_client_create(&clients[i]);
+	}
+	wl_event_loop_dispatch(loop, 0);
+
+	for (n = 1; n <= FOCUS_EVENTS; n++) {
+		i = (int)(n % NCLIENTS);
+		scripting_on_client_focus(&clients[i], &clients[(i + NCLIENTS - 1) % NCLIENTS]);
+		if (n % DESTROY_EVERY == 0) {
+			Client *c = &clients[(i + 1) % NCLIENTS];
+
+			scripting_on_client_destroy(c);
+			snprintf(c->title, sizeof(c->title), "client %ld", n);
+			scripting_on_client_create(c);
+		}
+		wl_event_loop_dispatch(loop, 0);
+		if (queue_len)
+			fail("events left after dispatch", n);
+
+		if (n % CHECK_EVERY != 0 && n != WARMUP)
+			continue;
+		live_objects = 0;
+		for (i = 0; i < object_count; i++)
+			live_objects += objects[i].id != 0;
+		if (live_objects > NCLIENTS)
+			fail("object table keeps destroyed clients", n);
+		wrenCollectGarbage(vm);
+		if (n == WARMUP)
+			baseline = heap_bytes;
+		else if (heap_bytes > baseline + HEAP_SLACK)
+			fail("Wren heap grew", n);
+		printf("%7ld events: %zu bytes after collection, %d objects\n",
+				n, heap_bytes, live_objects);
+	}
+	if (!hook_handles[HOOK_CLIENT_FOCUS] || !hook_handles[HOOK_CLIENT_DESTROY])
+		fail("a hook was dropped", n - 1);
+	if (!scripting_eval("if (Lost > 0) Fiber.abort(\"lost\")"))
+		fail("clientDestroy hooks saw a live client or no title", n - 1);
+
+	scripting_cleanup();
+	wl_event_loop_destroy(loop);
+	if (heap_bytes != 0)
+		fail("Wren memory left after scripting_cleanup", n - 1);
+	printf("peak %zu bytes, baseline %zu\n", heap_peak, baseline);
+	if (failures)
+		printf("%d failures\n", failures);
+	return failures ? 1 : 0;
+}